@@ -12,125 +12,460 @@
 *   probably be vastly improved to be more efficient, but it works.     *
 ************************************************************************/
 
+#include "SCI2FBCore.h"
+#include "SCI2FBResource.h"
+#include "SCI2FBVoiceStore.h"
+#include "SCI2FBVoiceParams.h"
+#include "SCI2FBStats.h"
+#include "SCI2FBMidi.h"
+#include "SCI2FBWatch.h"
+#include "SCI2FBServer.h"
+#include "SCI2FBAsync.h"
+#include "SCI2FBCache.h"
+#include "SCI2FBMap.h"
+#include "SCI2FBResolve.h"
+#include "SCI2FBZip.h"
+#include "SCI2FBQuiet.h"
+
 #include <fstream>
 #include <iostream>
+#include <sstream>
 #include <vector>
+#include <string>
 #include <iomanip>
-//#include <cstring>
+#include <cstring>
+#include <atomic>
+#include <mutex>
+#include <thread>
+#include <filesystem>
+#include <cstdio>
+#include <chrono>
+#include <functional>
+#include <random>
+#include <unordered_map>
+
+#ifdef _WIN32
+#include <io.h>
+#include <fcntl.h>
+#endif
 
 using namespace std;
 
 float nVersion = 1.01;
 
-void read_file(ifstream& file, vector<char>& data, streamoff titleOffset, int nVoices);
-void nibblize_data(vector<char>& data, vector<char>& splitData1, vector<char>* splitData2 = nullptr);
-void write_to_file(vector<char> splitData1, const char* output_bank1, vector<char>* splitData2 = nullptr, const char* output_bank2 = nullptr);
-bool check_file_exists(const char* filename);
-void overwrite_check(string output_filename);
+// Serializes console output and the overwrite prompt between batch worker threads
+mutex console_mutex;
+
+// What to do when an output file already exists
+enum class OverwritePolicy {
+    Ask,                    // Prompt for each file (the default)
+    Force,                  // --force: always replace it
+    SkipExisting,           // --skip-existing: never replace it
+    IfChanged,              // --if-changed: replace it only when the new contents differ
+};
+
+// Outcome of writing an output file under the overwrite policy
+enum class WriteResult {
+    Written,
+    Skipped,                // The existing file was left untouched
+    Failed,
+};
+
+// How the converted banks are written out
+enum class OutputFormat {
+    Split,                  // One .syx file per bank, _a.syx and _b.syx for two banks (the default)
+    Syx,                    // --format syx: both banks' messages in one .syx
+    Midi,                   // --format mid: the bank messages as sysex events in a type 0 .mid
+};
+
+// Options that apply to every mode. They're pulled out of the command line before the mode is picked.
+struct Options {
+    string voiceStore;      // --store dir: record every converted bank in this voice store
+    string cacheDir;        // --cache dir: reuse banks generated earlier from identical input
+    bool stats = false;     // --stats: print stage timings and I/O counters when done
+    bool statsJson = false; // --stats-json: the same as a single line of JSON
+    OverwritePolicy overwrite = OverwritePolicy::Ask;
+    OutputFormat format = OutputFormat::Split;
+    string midiPort;        // --midi port: send the banks to this MIDI port instead of writing files
+    MidiPacing pacing;      // --midi-chunk bytes, --midi-delay ms, --midi-per-voice
+    bool quiet = false;     // --quiet: print nothing, never prompt, and report only through the exit status
+    string badFormat;       // A --format value that isn't split, syx or mid, reported with the usage text
+    bool raw = false;       // --raw: also take headerless voice dumps, which only their size identifies
+};
+Options options;
+
+VoiceStore voice_store;
+MidiOut midi_out;
+ConversionCache conversion_cache;
+FileResolver file_resolver;
+Stats stats;
+
+int convert_patch_file(const char* patfile_name, const char* output_bank, ostream& log, bool toStdout = false, FILE* patfile = nullptr);
+int convert_patch_image(const char* image, streamoff length, const char* patfile_name, const char* output_bank, ostream& log, bool toStdout = false, int* nBanks = nullptr,
+                        const PatchLayout* knownLayout = nullptr);
+void generate_banks(const char* image, size_t length, const PatchLayout& layout, const char* label1, const char* label2, RawBank& data1, RawBank& data2, SysexBank& splitData1, SysexBank& splitData2);
+int convert_one_bank(const char* image, const PatchLayout& layout, const char* output_bank, int bank, ostream& log);
+streamoff read_image(const char* filename, char* image, size_t size);
+streamoff read_image(FILE* file, char* image, size_t size);
+WriteResult write_to_file(const SysexBank& splitData1, const char* output_bank1, const SysexBank* splitData2 = nullptr, const char* output_bank2 = nullptr, bool toStdout = false);
+WriteResult write_image(const char* image, size_t length, const char* filename);
+WriteResult write_single_file(const SysexBank& splitData1, const SysexBank* splitData2, const char* filename, bool toStdout);
+bool same_contents(const char* image, size_t length, const char* filename);
+bool write_stdout(const SysexBank& splitData1, const SysexBank* splitData2 = nullptr);
+bool write_stdout(const char* image, size_t length);
+void set_binary_mode(FILE* stream);
+bool store_voices(const RawBank& data1, const RawBank* data2, const char* patfile_name);
+int run_voice_users(int argc, char* argv[]);
+int run_similar(int argc, char* argv[]);
+int run_build_bank(int argc, char* argv[]);
+bool load_voice_source(const string& filename, vector<RawBank>& banks, string& error);
+int run_bench(int argc, char* argv[]);
+int run_self_test(int argc, char* argv[]);
+bool resolve_patfile(string& patfile_name);
+bool overwrite_check(string output_filename);
+int run_batch(int argc, char* argv[]);
+bool is_patch_file(const string& filename);
+bool is_bank_file(const string& filename);
+void collect_batch_inputs(const char* arg, vector<string>& inputs, int& nMissing, bool (*accept)(const string&) = is_patch_file);
+int run_reverse(int argc, char* argv[]);
+int run_game(int argc, char* argv[]);
+int run_voices(int argc, char* argv[]);
+int run_watch(int argc, char* argv[]);
+int run_serve(int argc, char* argv[]);
+int run_check(int argc, char* argv[]);
+int run_verify(int argc, char* argv[]);
+bool check_patch_file(const char* filename, PatchLayout& layout, PatchError& error);
+bool parse_voice_list(const char* list, vector<int>& voices);
+bool has_extension(const string& filename, const char* ext);
+
+int run_command(int argc, char* argv[], ostream& console, bool toStdout);
+int run_quiet(int argc, char* argv[]);
 
 int main(int argc, char* argv[]) {
+    // Pull the global options out of the command line so the modes below only see their own arguments
+    int nArgs = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--store") == 0 && i + 1 < argc) options.voiceStore = argv[++i];
+        else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) options.cacheDir = argv[++i];
+        else if (strcmp(argv[i], "--stats") == 0) options.stats = true;
+        else if (strcmp(argv[i], "--stats-json") == 0) options.statsJson = true;
+        else if (strcmp(argv[i], "--force") == 0) options.overwrite = OverwritePolicy::Force;
+        else if (strcmp(argv[i], "--skip-existing") == 0) options.overwrite = OverwritePolicy::SkipExisting;
+        else if (strcmp(argv[i], "--if-changed") == 0) options.overwrite = OverwritePolicy::IfChanged;
+        else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+            i++;
+            if (strcmp(argv[i], "syx") == 0) options.format = OutputFormat::Syx;
+            else if (strcmp(argv[i], "mid") == 0) options.format = OutputFormat::Midi;
+            else if (strcmp(argv[i], "split") == 0) options.format = OutputFormat::Split;
+            else options.badFormat = argv[i];
+        }
+        else if (strcmp(argv[i], "--midi") == 0 && i + 1 < argc) options.midiPort = argv[++i];
+        else if (strcmp(argv[i], "--midi-chunk") == 0 && i + 1 < argc) options.pacing.chunkSize = static_cast<size_t>(atoi(argv[++i]));
+        else if (strcmp(argv[i], "--midi-delay") == 0 && i + 1 < argc) options.pacing.delayMs = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--midi-per-voice") == 0) options.pacing.perVoice = true;
+        else if (strcmp(argv[i], "--quiet") == 0) options.quiet = true;
+        else if (strcmp(argv[i], "--raw") == 0) options.raw = true;
+        else argv[nArgs++] = argv[i];
+    }
+    argc = nArgs;
+
+    // An unknown output format is a usage error rather than a guess, so nothing gets converted with it
+    if (!options.badFormat.empty()) argc = 1;
+    if (options.quiet) return run_quiet(argc, argv);
+
     // Check if the user provided arguments
-    
-    cout << fixed;
-    cout << setprecision(2);
-    cout << "\nSCI2FB  v" << nVersion << "    by Brandon Blume" << endl;
 
-    if (argc != 2 && argc != 3) {
-        cout << "   usage:   " << argv[0] << "   patfile  [output_bank]\n";
-        return 1;
+    // An output_bank of "-" sends the sysex stream to stdout, so every message goes to stderr instead
+    // (argv[1] is the input, where "-" means stdin)
+    bool toStdout = false;
+    for (int i = 2; i < argc; i++) toStdout = toStdout || (strcmp(argv[i], "-") == 0);
+    ostream& console = toStdout ? cerr : cout;
+
+    console << fixed;
+    console << setprecision(2);
+    console << "\nSCI2FB  v" << nVersion << "    by Brandon Blume" << endl;
+
+    if (options.stats || options.statsJson) stats.enable();
+    int result = run_command(argc, argv, console, toStdout);
+    if (options.stats) stats.print(console);
+    if (options.statsJson) stats.print_json(console);
+    return result;
+}
+
+int run_quiet(int argc, char* argv[]) {
+    // A plain conversion with none of the options that need the rest of the tool goes through the stream-free
+    // path. Anything else runs as usual with the console streams switched off, which makes insertions into
+    // them return at once.
+    bool toStdout = (argc == 3 || argc == 4) && strcmp(argv[2], "-") == 0;
+    bool plain = (argc == 2 || argc == 3 || (argc == 4 && toStdout)) && (argv[1][0] != '-' || argv[1][1] == '\0') &&
+                 options.voiceStore.empty() && options.cacheDir.empty() && options.midiPort.empty() && !options.stats &&
+                 !options.statsJson && options.format == OutputFormat::Split;
+    if (plain) {
+        QuietOverwrite overwrite = (options.overwrite == OverwritePolicy::Force)          ? QuietOverwrite::Force
+                                   : (options.overwrite == OverwritePolicy::SkipExisting) ? QuietOverwrite::SkipExisting
+                                   : (options.overwrite == OverwritePolicy::IfChanged)    ? QuietOverwrite::IfChanged
+                                                                                          : QuietOverwrite::Refuse;
+        // The name is resolved first, as in the normal path, so the default output name comes from the file
+        // actually found ("./kq4" gives kq4_a.syx, "KQ4" on a case-sensitive system the name on disk)
+        string patfile_name = argv[1];
+        if (patfile_name != "-" && !resolve_patfile(patfile_name)) return 1;
+        string output_bank = (argc == 4) ? argv[3] : (argc == 3 && !toStdout) ? argv[2] : (patfile_name == "-") ? "patch" : patfile_name;
+        return (convert_quiet(patfile_name.c_str(), output_bank.c_str(), toStdout, overwrite, options.raw) == QUIET_OK) ? 0 : 1;
     }
-    cout << "---------------------------------" << endl;
 
-    // Get the patfile filename from command line arguments
-    char patfile_name[256];
-    strcpy(patfile_name, argv[1]);
-    
-    if (!strrchr(patfile_name, '.')) {
-        // Input patfile does not contain a file extension.
-
-        if (!check_file_exists(patfile_name)) { // If patfile without an extension doesn't exist
-            strcat(patfile_name, ".pat");
-            if (!check_file_exists(patfile_name)) { // If patfile with ".pat" extension doesn't exist
-                strcpy(patfile_name + strlen(patfile_name) - 3, "002");
-                if (!check_file_exists(patfile_name)) { // If patfile with ".002" extension doesn't exist
-                    // Out of options, give up
-                    patfile_name[strlen(patfile_name) - 4] = '\0';
-                    cout << "Error: file " << patfile_name << " not found" << endl;
-                    return 1;
-                }
-            }
+    cout.setstate(ios::failbit);
+    cerr.setstate(ios::failbit);
+    if (options.stats || options.statsJson) stats.enable();
+    return run_command(argc, argv, cout, argc >= 3 && strcmp(argv[2], "-") == 0);
+}
+
+int run_command(int argc, char* argv[], ostream& console, bool toStdout) {
+    // Benchmark of the conversion stages on synthetic in-memory patches
+    if (argc >= 2 && strcmp(argv[1], "--bench") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_bench(argc - 2, argv + 2);
+    }
+
+    // Self-test: golden outputs, fast paths against the reference conversion, fuzzed patch checks, throughput
+    if (argc >= 2 && strcmp(argv[1], "--self-test") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_self_test(argc - 2, argv + 2);
+    }
+
+    // Voice store lookup: which recorded banks use a voice
+    if (argc >= 2 && strcmp(argv[1], "--voice-users") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_voice_users(argc - 2, argv + 2);
+    }
+
+    // Similarity search: the stored voices whose parameters come closest to a given voice
+    if (argc >= 2 && strcmp(argv[1], "--similar") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_similar(argc - 2, argv + 2);
+    }
+
+    // Bank librarian: a new bank put together from voices listed in a manifest
+    if (argc >= 2 && strcmp(argv[1], "--build-bank") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_build_bank(argc - 2, argv + 2);
+    }
+
+    if (!options.voiceStore.empty()) {
+        string error;
+        if (!voice_store.open(options.voiceStore, error)) {
+            console << "Error: " << error << endl;
+            return 1;
+        }
+    }
+
+    if (!options.cacheDir.empty()) {
+        string error;
+        if (!conversion_cache.open(options.cacheDir, error)) {
+            console << "Error: " << error << endl;
+            return 1;
+        }
+    }
+
+    if (!options.midiPort.empty()) {
+        string error;
+        if (!midi_out.open(options.midiPort, error)) {
+            console << "Error: " << error << endl;
+            return 1;
         }
     }
+
+    // Voice extraction: a few voices out of a patch file, as single voice messages or a new bank
+    if (argc >= 2 && (strcmp(argv[1], "--voice") == 0 || strcmp(argv[1], "--voices") == 0)) {
+        console << "---------------------------------" << endl;
+        return run_voices(argc - 2, argv + 2);
+    }
+
+    // Batch mode: everything after the switch is an input file, a directory or an @listfile
+    if (argc >= 2 && (strcmp(argv[1], "-b") == 0 || strcmp(argv[1], "--batch") == 0)) {
+        cout << "---------------------------------" << endl;
+        return run_batch(argc - 2, argv + 2);
+    }
+
+    // Check mode: validate patch files from their header bytes only, without converting them
+    if (argc >= 2 && strcmp(argv[1], "--check") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_check(argc - 2, argv + 2);
+    }
+
+    // Verify mode: check the packet checksums of existing .syx bank dumps
+    if (argc >= 2 && strcmp(argv[1], "--verify") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_verify(argc - 2, argv + 2);
+    }
+
+    // Watch mode: re-convert patch files in a directory whenever they change
+    if (argc >= 2 && strcmp(argv[1], "--watch") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_watch(argc - 2, argv + 2);
+    }
+
+    // Server mode: convert patches sent over a socket, in memory, until killed
+    if (argc >= 2 && strcmp(argv[1], "--serve") == 0) {
+        cout << "---------------------------------" << endl;
+        return run_serve(argc - 2, argv + 2);
+    }
+
+    // Reverse mode: FB-01 sysex bank dump(s) back to an SCI patch resource
+    if (argc >= 2 && (strcmp(argv[1], "-r") == 0 || strcmp(argv[1], "--reverse") == 0)) {
+        cout << "---------------------------------" << endl;
+        return run_reverse(argc - 2, argv + 2);
+    }
+
+    // Game mode: convert patch resource 2 straight out of a game's resource volumes
+    if (argc >= 2 && (strcmp(argv[1], "-g") == 0 || strcmp(argv[1], "--game") == 0)) {
+        cout << "---------------------------------" << endl;
+        return run_game(argc - 2, argv + 2);
+    }
+
+    if ((argc != 2 && argc != 3 && argc != 4) || (argc == 4 && !toStdout)) {
+        if (!options.badFormat.empty()) console << "Error: unknown format " << options.badFormat << "\n";
+        console << "   usage:   " << argv[0] << "   patfile|-  [output_bank]\n";
+        console << "            " << argv[0] << "   patfile|-  -  [label]\n";
+        console << "            " << argv[0] << "   -b [-j threads]  [--io-depth n]  patfile|directory|@listfile ...\n";
+        console << "            " << argv[0] << "   --check  patfile|directory|@listfile ...\n";
+        console << "            " << argv[0] << "   --verify  [-j threads]  bank.syx|directory|@listfile ...\n";
+        console << "            " << argv[0] << "   --watch  directory  [--debounce ms]\n";
+        console << "            " << argv[0] << "   --serve  [-j threads]  unix:socket|[host:]port\n";
+        console << "            " << argv[0] << "   -r  bank.syx  [bank_b.syx]  [patfile]\n";
+        console << "            " << argv[0] << "   -g  gamedir|game.zip  [output_bank]\n";
+        console << "            " << argv[0] << "   --voices  list  patfile  [output]  [--bank]\n";
+        console << "            " << argv[0] << "   --voice-users  storedir  hash\n";
+        console << "            " << argv[0] << "   --similar  storedir  hash|source voice  [-n count]\n";
+        console << "            " << argv[0] << "   --build-bank  manifest  [output_bank]\n";
+        console << "            " << argv[0] << "   --bench  [seconds_per_stage]\n";
+        console << "            " << argv[0] << "   --self-test  [min_Mvoices_per_sec]\n";
+        console << "   options: --store storedir  --cache cachedir  --stats  --stats-json  --force|--skip-existing|--if-changed\n";
+        console << "            --quiet  --raw\n";
+        console << "            --format split|syx|mid\n";
+        console << "            --midi port  [--midi-chunk bytes]  [--midi-delay ms]  [--midi-per-voice]\n";
+        return 1;
+    }
+    console << "---------------------------------" << endl;
+
+    // Get the patfile filename from command line arguments. "-" reads the patch from stdin.
+    string patfile_name = argv[1];
+
+    // The resolver opens the file it finds, and the conversion reads from that same handle
+    FILE* patfile = nullptr;
+    if (patfile_name != "-" && !(patfile = file_resolver.open(patfile_name))) {
+        console << "Error: file " << patfile_name << " not found" << endl;
+        return 1;
+    }
+
+    // If given, get output_bank filename from the command line arguments (when writing to stdout, the
+    // optional label takes its place). If output_bank was not specified, pull the name from patfile instead,
+    // or use "patch" (as in PATCH.002) when the patch comes from stdin.
+    string output_bank = (patfile_name == "-") ? "patch" : patfile_name;
+    if (argc == 3 && !toStdout) output_bank = argv[2];
+    if (argc == 4) output_bank = argv[3];
+
+    return convert_patch_file(patfile_name.c_str(), output_bank.c_str(), console, toStdout, patfile);
+}
+
+int convert_patch_file(const char* patfile_name, const char* output_bank_name, ostream& log, bool toStdout, FILE* patfile) {
+    Stats::Clock::time_point start = stats.now();
+
+    // Read the whole patfile into memory with a single read, then close it. Everything past this point works
+    // from the in-memory image. One byte more than the largest valid patch file is requested so that an
+    // oversized file can't pass for an exact SCI0 size below.
+    char image[MAX_PATCH_SIZE + 1];
+    streamoff length = 0;
+    if (strcmp(patfile_name, "-") == 0) {
+        // Pipe mode: fread keeps reading until the buffer is full or stdin reaches end of file
+        set_binary_mode(stdin);
+        length = fread(image, 1, sizeof(image), stdin);
+        stats.add_io(1, length, 0);
+    }
     else {
-        // Check if patfile with a user-inputted file extension exists
-        if (!check_file_exists(patfile_name)) {
-            cout << "Error: file " << patfile_name << " not found" << endl;
+        length = patfile ? read_image(patfile, image, sizeof(image)) : read_image(patfile_name, image, sizeof(image));
+        if (length < 0) {
+            log << "Error: could not open " << patfile_name << endl;
+            stats.add_file(false, 0, start);
             return 1;
         }
     }
+    stats.lap(STAGE_READ, start);
 
-    // If given, get output_bank filename from the command line arguments
-    // If output_bank was not specified, pull the name from patfile instead
-    char output_bank[256];
-    if (argc == 2) strcpy(output_bank, patfile_name);
-    if (argc == 3) strcpy(output_bank, argv[2]);
-    // Drop any extension given (we'll make out own later)
-    if (char* ext_pos = strrchr(output_bank, '.')) *ext_pos = '\0';
-    
-    
-    // Open patfile
-    ifstream patfile(patfile_name, ios::binary);
-    patfile.exceptions(ios::failbit | ios::badbit);
-    // Check if the SCI patch resource identifier header exists
-    patfile.seekg(0x00);
-    char buffer[2];
-    patfile.read(buffer, 1);
-    if (buffer[0] != (char)0x89) {
-        cout << "Error: invalid header! Input file is corrupt or not a valid SCI patch resource" << endl;
-        exit(EXIT_FAILURE);
+    int nBanks = 0;
+    int result = convert_patch_image(image, length, patfile_name, output_bank_name, log, toStdout, &nBanks);
+    stats.add_file(result == 0, nBanks, start);
+    return result;
+}
+
+streamoff read_image(const char* filename, char* image, size_t size) {
+    // One open, one read of up to "size" bytes and a close. Returns -1 when the file can't be opened.
+    ifstream file(filename, ios::binary);
+    if (!file.good()) {
+        stats.add_io(1, 0, 0);
+        return -1;
     }
+    file.read(image, size);
+    streamoff length = file.gcount();
+    file.close();
+    stats.add_io(3, length, 0);
+    return length;
+}
 
-    // Check for title string length in second byte of header to use as offset for future file handling
-    patfile.seekg(0x01);
-    char titleStringSize[1];
-    patfile.read(titleStringSize, 1);
-    streamoff titleOffset = static_cast<streamoff>(static_cast<int>(titleStringSize[0]));
+streamoff read_image(FILE* file, char* image, size_t size) {
+    // The same for a file already opened (and here closed); the open is counted with the read
+    size_t length = fread(image, 1, size, file);
+    bool failed = ferror(file) != 0;
+    fclose(file);
+    stats.add_io(3, length, 0);
+    return failed ? -1 : static_cast<streamoff>(length);
+}
 
-    // Check size of file to ensure it's valid
-    patfile.seekg(0, ios::end);
-    streamoff length = patfile.tellg();
-    patfile.seekg(0, ios::beg);
+int convert_patch_image(const char* image, streamoff length, const char* patfile_name, const char* output_bank_name, ostream& log, bool toStdout, int* nBanksOut,
+                        const PatchLayout* knownLayout) {
+    char output_bank[256];
+    if (strlen(output_bank_name) >= sizeof(output_bank) - 6) {
+        log << "Error: output name " << output_bank_name << " is too long" << endl;
+        return 1;
+    }
+    strcpy(output_bank, output_bank_name);
+    // Drop any extension given (we'll make out own later)
+    if (char* ext_pos = strrchr(output_bank, '.')) *ext_pos = '\0';
 
-    if (length != 6148 + titleOffset && length != 3074 + titleOffset) {
-        cout << patfile_name << " is not the expected size (3074 or 6148 bytes + title string length). Not a valid FB-01 SCI0 Patch file." 
-            << endl << "Actual size: " << length << endl << "Title string length: " << static_cast<int>(titleStringSize[0]) << endl;
+    // Work out which variant of patch the image is and whether it holds one or two banks, unless the caller
+    // already worked that out from where the image was found
+    Stats::Clock::time_point t = stats.now();
+    PatchLayout layout;
+    PatchError error = knownLayout ? PatchError::None : find_patch_layout(image, length, layout, options.raw);
+    if (knownLayout) layout = *knownLayout;
+    int nBanks = layout.nBanks;
+    stats.lap(STAGE_VALIDATE, t);
+    if (error == PatchError::InvalidSize) {
+        log << patfile_name << " is " << patch_error_message(error)
+            << endl << "Actual size: " << length << endl << "Title string length: " << static_cast<int>(static_cast<unsigned char>(image[1])) << endl;
+        return 1;
+    }
+    if (error != PatchError::None) {
+        log << "Error: " << patch_error_message(error) << endl;
         return 1;
     }
+    if (nBanksOut) *nBanksOut = nBanks;
+    if (layout.format != PatchFormat::Sci0) log << "Reading " << patfile_name << " (" << patch_format_name(layout.format) << ")" << endl;
 
-    //
-    // Determine if patfile has one or two banks and set nVoices appropriately for later loop iteration
-    //
+    // The conversion runs stage by stage rather than through convert_patch, so each stage can be timed and
+    // the voices pulled out of the image can go on to the voice store as well. The raw voices and generated
+    // sysex banks live in fixed-size arrays, so the conversion itself never touches the heap
+    RawBank data1;
+    RawBank data2;
+    SysexBank splitData1;
+    SysexBank splitData2;
 
-    int nVoices = 0;
-    vector<char> data;
+    // The banks go to files unless they're being piped or sent to a MIDI port
+    bool toFiles = !toStdout && !midi_out.is_open();
 
     //
     // Patfile contains two banks (96 voices)
     //
-    if (length == 6148 + titleOffset) {
-        nVoices = 96;
-        // Ensure the ABCDh bytes exist at address 0xC02 between the two banks
-        // (offset by the title string length from the file header)
-        patfile.seekg(0xC02 + titleOffset);
-        patfile.read(buffer, 2);
-        if (buffer[0] != (char)0xAB && buffer[1] != (char)0xCD) {
-            cout << "Error: bank separator bytes missing! Input file is not a valid FB-01 SCI patch resource." << endl;
-            return 1;
-        }
-        // Read the input patch file into memory, then close the input file
-        read_file(patfile, data, titleOffset, nVoices);
-        patfile.close();
-
+    if (nBanks == 2) {
         // Prepare two output sysex bank filenames
         char output_bank1[256];
         char output_bank2[256];
@@ -138,296 +473,1540 @@ int main(int argc, char* argv[]) {
         strcat(output_bank1, "_a.syx");
         strcpy(output_bank2, output_bank);
         strcat(output_bank2, "_b.syx");
-        // Check if output bank files 1 and 2 already exist. If they do, ask user whether to overwrite or abort
-        overwrite_check(output_bank1);
-        overwrite_check(output_bank2);
+        // With --format syx or mid both banks go into one file named after the patch instead, still labelled
+        // as they would be in files of their own
+        bool single = (options.format != OutputFormat::Split);
+        char output_single[256];
+        strcpy(output_single, output_bank);
+        strcat(output_single, (options.format == OutputFormat::Midi) ? ".mid" : ".syx");
+        string outputs = single ? string(output_single) : string(output_bank1) + " / " + output_bank2;
 
-        // Split the bytes of each instrument voice packet in order of: low nibble = high byte, high nibble = low byte
-        vector<char> splitData1;
-        vector<char> splitData2;
-        splitData1.reserve(data.size());
-        splitData2.reserve(data.size());
-        splitData1.clear();
-        splitData2.clear();
+        // Check if output bank files 1 and 2 already exist. If they do, ask user whether to overwrite or abort
+        if (toFiles && (single ? !overwrite_check(output_single) : (!overwrite_check(output_bank1) || !overwrite_check(output_bank2)))) return 1;
 
-        nibblize_data(data, splitData1, &splitData2);
+        // Convert both banks, labelled from their output filenames
+        generate_banks(image, length, layout, output_bank1, output_bank2, data1, data2, splitData1, splitData2);
 
         // Create the sysex bank files with the new "nibblized" data
-        write_to_file(splitData1, output_bank1, &splitData2, output_bank2);
+        t = stats.now();
+        WriteResult written = (single && !midi_out.is_open()) ? write_single_file(splitData1, &splitData2, output_single, toStdout)
+                                                              : write_to_file(splitData1, output_bank1, &splitData2, output_bank2, toStdout);
+        stats.lap(STAGE_WRITE, t);
+        if (written == WriteResult::Failed) {
+            log << "Error: could not write " << outputs << endl;
+            return 1;
+        }
 
-        cout << "Two FB-01 sysex banks successfully created!" << endl;
+        if (written == WriteResult::Skipped) log << outputs << (single ? " already exists" : " already exist") << ", left untouched" << endl;
+        else if (midi_out.is_open()) log << "Two FB-01 sysex banks sent to MIDI port " << options.midiPort << endl;
+        else log << "Two FB-01 sysex banks successfully created!" << endl;
     }
 
     //
     // Patfile contains only one bank (48 voices)
     //
-    else if (length == 3074 + titleOffset) {
-        nVoices = 48;
-        // Read the input patch file into memory, then close the input file
-        read_file(patfile, data, titleOffset, nVoices);
-        patfile.close();
-
-        // Prepare single output sysex bank filename
+    else {
+        // Prepare single output sysex bank filename. With --format mid the bank goes into a .mid of the same
+        // name instead, still labelled from the .syx name.
         strcat(output_bank, ".syx");
-        overwrite_check(output_bank);
+        bool midiFile = (options.format == OutputFormat::Midi);
+        char output_midi[256];
+        strcpy(output_midi, output_bank);
+        strcpy(output_midi + strlen(output_midi) - 4, ".mid");
+        const char* output_name = midiFile ? output_midi : output_bank;
+        if (toFiles && !overwrite_check(output_name)) return 1;
 
-        // Split the bytes of each instrument voice packet in order of: low nibble = high byte, high nibble = low byte
-        vector<char> splitData1;
-        splitData1.reserve(data.size());
-        splitData1.clear();
-
-        nibblize_data(data, splitData1);
+        generate_banks(image, length, layout, output_bank, nullptr, data1, data2, splitData1, splitData2);
 
         // Create the single sysex bank file with the new "nibblized" data
-        write_to_file(splitData1, output_bank);
+        t = stats.now();
+        WriteResult written = (midiFile && !midi_out.is_open()) ? write_single_file(splitData1, nullptr, output_midi, toStdout)
+                                                                : write_to_file(splitData1, output_bank, nullptr, nullptr, toStdout);
+        stats.lap(STAGE_WRITE, t);
+        if (written == WriteResult::Failed) {
+            log << "Error: could not write " << output_name << endl;
+            return 1;
+        }
 
-        cout << "FB-01 sysex bank successfully created!" << endl;
+        if (written == WriteResult::Skipped) log << output_name << " already exists, left untouched" << endl;
+        else if (midi_out.is_open()) log << "FB-01 sysex bank sent to MIDI port " << options.midiPort << endl;
+        else log << "FB-01 sysex bank successfully created!" << endl;
+    }
+
+    if (!options.voiceStore.empty() && !store_voices(data1, (nBanks == 2) ? &data2 : nullptr, patfile_name)) {
+        log << "Error: could not add the voices to " << options.voiceStore << endl;
+        return 1;
     }
 
     return 0;
 }
 
-void read_file(ifstream& file, vector<char>& data, streamoff titleOffset, int nVoices) {
-    // Read the file starting at the first voice data byte after the header bytes. Iterate through each
-    // byte for each of the 96 voices. (we must skip the separator bytes ABCDh on voice 49, which is
-    //      voice 1 of bank B)
-    streampos pos = 0x02 + titleOffset;
-
-    for (int i = 0; i < nVoices; i++) {
-        // If patch file has 2 banks and we've reached the end of bank 1, skip the bank separator bytes ABCDh
-        if (nVoices == 96 && i == 48) pos += 2;
-        
-        // Store the instrument voice data into "data"
-        file.seekg(pos);
-        char buffer[64];
-        file.read(buffer, 64);
-        data.insert(data.end(), buffer, buffer + 64);
-        pos += 64;
-    }
-}
-
-void nibblize_data(vector<char>& data, vector<char>& splitData1, vector<char>* splitData2) {
-    // Check to ensure that both sets of instrument voice packets equal 6144 bytes in length (64 bytes per 96 voices form the patch file).
-    if (data.size() != 6144 && data.size() != 3072) {
-        cout << "Error: data vector not the expected size (6144 or 3072)" << endl;
-        cout << "Actual size = " << data.size() << endl;
-        exit(EXIT_FAILURE);
-    }
-    
-    //////////////////////////////////////////////////////////////////////////////////////////////
-    //  Now we must nibblize the voice patch data by splitting each byte into pairs and         //
-    //  and storing them in order: low nibble = high byte, high nibble = low byte's low nibble. //
-    //  This will prepare the voice data properly for the sysex format and double the size of   //
-    //  each voice's byte data adding leading bytes (0x01 0x00) to signify the size of the      //
-    //  packet (128) and a checksum byte calculate with 2's complement of sum following it.     //
-    //  (131 bytes total per instrument voice)                                                  //
-    //////////////////////////////////////////////////////////////////////////////////////////////
-
-    // First 48 instrument voice packets (bank A)
-    for (int i = 0; i < 48; i++) {
-        
-        // set the high-byted packet size value bytes that precede the packet (0x01 0x00 = 128)
-        splitData1.push_back(0x01);
-        splitData1.push_back(0x00);
-        
-        // 64 bytes per packet
-        for (int j = 0; j < 64; j++) {
-            int index = i * 64 + j;
-            splitData1.push_back(data[index] & 0x0F);
-            splitData1.push_back((data[index] >> 4) & 0x0F);
-        }
-        
-        // calculate checksum with 2's complement of sum
-        unsigned char checksum = 0;
-        for (int j = 2; j < 130; j++) {
-            checksum += static_cast<unsigned int>(splitData1[i * 131 + j]);
-        }
-        checksum = ((~(checksum & 0xFF)) + 1) & 0x7F;
-        splitData1.push_back(checksum);
-    }
-
-    // Second 48 instrument voice packets (bank B)
-    if (splitData2) {
-        for (int i = 0; i < 48; i++) {
-            // set packet size of nibblized bytes preceding the packet:
-            //          0x01 0x00 = 128 (%0000000h, %0lllllll -> %00000000, %hlllllll)
-            (*splitData2).push_back(0x01);
-            (*splitData2).push_back(0x00);
-
-            // 64 bytes per packet
-            for (int j = 0; j < 64; j++) {
-                int index = (48 + i) * 64 + j;
-                (*splitData2).push_back(data[index] & 0x0F);
-                (*splitData2).push_back((data[index] >> 4) & 0x0F);
+void generate_banks(const char* image, size_t length, const PatchLayout& layout, const char* label1, const char* label2, RawBank& data1, RawBank& data2, SysexBank& splitData1, SysexBank& splitData2) {
+    // An input converted before under the same labels comes straight out of the conversion cache. The voices
+    // are still extracted for the voice store, which needs them either way.
+    Stats::Clock::time_point t = stats.now();
+    bool twoBanks = (layout.nBanks == 2);
+    CacheKey key = 0;
+    bool cached = false;
+    if (conversion_cache.is_open()) {
+        key = ConversionCache::key(image, length, label1, label2);
+        cached = conversion_cache.load(key, splitData1, twoBanks ? &splitData2 : nullptr);
+        t = stats.lap(STAGE_CACHE, t);
+    }
+    if (cached && options.voiceStore.empty()) return;
+
+    read_patch(image, layout, data1, twoBanks ? &data2 : nullptr);
+    t = stats.lap(STAGE_EXTRACT, t);
+    if (cached) return;
+
+    nibblize_data(data1, splitData1);
+    if (twoBanks) nibblize_data(data2, splitData2);
+    t = stats.lap(STAGE_NIBBLIZE, t);
+    build_bank_header(splitData1, 0, label1, twoBanks);
+    if (twoBanks) build_bank_header(splitData2, 1, label2, twoBanks);
+    t = stats.lap(STAGE_HEADER, t);
+
+    // A failed store only costs the next run a conversion
+    if (conversion_cache.is_open()) {
+        conversion_cache.store(key, splitData1, twoBanks ? &splitData2 : nullptr);
+        stats.lap(STAGE_CACHE, t);
+    }
+}
+
+bool store_voices(const RawBank& data1, const RawBank* data2, const char* patfile_name) {
+    if (!voice_store.add_bank(data1, patfile_name, 0)) return false;
+    return !data2 || voice_store.add_bank(*data2, patfile_name, 1);
+}
+
+int run_batch(int argc, char* argv[]) {
+    // Number of worker threads, defaults to one per hardware core
+    unsigned nThreads = thread::hardware_concurrency();
+    // Patch file reads kept in flight ahead of the workers (0 reads each file when a worker gets to it)
+    unsigned ioDepth = 64;
+    vector<string> inputs;
+    int nMissing = 0;
+
+    for (int i = 0; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            nThreads = static_cast<unsigned>(atoi(argv[++i]));
+            continue;
+        }
+        if ((strcmp(argv[i], "--io-depth") == 0) && i + 1 < argc) {
+            ioDepth = static_cast<unsigned>(atoi(argv[++i]));
+            continue;
+        }
+        collect_batch_inputs(argv[i], inputs, nMissing);
+    }
+
+    if (inputs.empty()) {
+        cout << "Error: no patch files to convert" << endl;
+        return 1;
+    }
+    if (nThreads == 0) nThreads = 1;
+    if (nThreads > inputs.size()) nThreads = static_cast<unsigned>(inputs.size());
+
+    // The reads run ahead of the conversion: while the workers convert and write, up to ioDepth more patch
+    // files are being read into the reader's buffers. Each worker holds on to one buffer while converting
+    // from it, so there's one buffer per worker on top of those being read.
+    AsyncReader reader;
+    reader.open(inputs, MAX_PATCH_SIZE + 1, ioDepth + nThreads, ioDepth > 0);
+    stats.set_io_backend(reader.backend());
+
+    // Each worker takes the next patch file to finish reading. A file's messages are collected separately
+    // and printed in one piece so output from different workers doesn't interleave.
+    atomic<int> nSucceeded(0);
+    atomic<int> nFailed(nMissing);
+
+    auto worker = [&]() {
+        AsyncRead read;
+        for (;;) {
+            Stats::Clock::time_point start = stats.now();
+            if (!reader.next(read)) break;
+            stats.lap(STAGE_READ, start);
+            const char* patfile_name = inputs[read.index].c_str();
+
+            ostringstream log;
+            int result = 1;
+            int nBanks = 0;
+            if (read.length < 0) {
+                stats.add_io(1, 0, 0);
+                log << "Error: could not open " << patfile_name << endl;
+            }
+            else {
+                stats.add_io(3, read.length, 0);
+                try {
+                    result = convert_patch_image(read.data, read.length, patfile_name, patfile_name, log, false, &nBanks);
+                }
+                catch (const exception&) {
+                    log << "Error: could not convert " << patfile_name << endl;
+                }
             }
+            reader.release(read);
+            stats.add_file(result == 0, nBanks, start);
+            (result == 0) ? nSucceeded++ : nFailed++;
+
+            lock_guard<mutex> lock(console_mutex);
+            cout << patfile_name << ": " << log.str();
+        }
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 0; t < nThreads; t++) pool.emplace_back(worker);
+    for (thread& t : pool) t.join();
+
+    // Files the reader gave up on without handing out count as failures too
+    nFailed = static_cast<int>(inputs.size()) + nMissing - nSucceeded;
+
+    cout << "---------------------------------" << endl;
+    cout << nSucceeded << " of " << (inputs.size() + nMissing) << " patch files converted, " << nFailed << " failed" << endl;
+    if (!options.voiceStore.empty()) {
+        cout << voice_store.voices_added() << " voices added to " << options.voiceStore << ", " << voice_store.voices_new()
+             << " of them new, " << voice_store.voices_stored() << " unique voices stored" << endl;
+    }
+    if (conversion_cache.is_open()) {
+        cout << conversion_cache.hits() << " cache hits, " << conversion_cache.misses() << " misses in " << options.cacheDir << endl;
+    }
 
-            // calculate checksum with 2's complement of sum
-            unsigned char checksum = 0;
-            for (int j = 2; j < 130; j++) {
-                checksum += static_cast<unsigned int>((*splitData2)[i * 131 + j]);
+    return (nFailed == 0) ? 0 : 1;
+}
+
+void collect_batch_inputs(const char* arg, vector<string>& inputs, int& nMissing, bool (*accept)(const string&)) {
+    // "@listfile" names a text file with one patch file path per line
+    if (arg[0] == '@') {
+        ifstream list(arg + 1);
+        if (!list.good()) {
+            cout << "Error: file list " << (arg + 1) << " not found" << endl;
+            nMissing++;
+            return;
+        }
+        string line;
+        while (getline(list, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) collect_batch_inputs(line.c_str(), inputs, nMissing, accept);
+        }
+        return;
+    }
+
+    // A directory contributes every file "accept" picks up beneath it (normally the .pat and .002 files)
+    error_code ec;
+    if (filesystem::is_directory(arg, ec)) {
+        for (const auto& entry : filesystem::recursive_directory_iterator(arg, ec)) {
+            if (!entry.is_regular_file(ec)) continue;
+            string name = entry.path().string();
+            if (accept(name)) inputs.push_back(name);
+        }
+        return;
+    }
+
+    // Anything else is a patch file name, resolved the same way as in single file mode
+    string patfile_name = arg;
+    if (!resolve_patfile(patfile_name)) {
+        cout << "Error: file " << patfile_name << " not found" << endl;
+        nMissing++;
+        return;
+    }
+    inputs.push_back(patfile_name);
+}
+
+int run_reverse(int argc, char* argv[]) {
+    // Arguments ending in ".syx" are bank dumps, anything else names the output patch file
+    vector<string> bank_files;
+    string patfile_name;
+    for (int i = 0; i < argc; i++) {
+        if (has_extension(argv[i], ".syx")) bank_files.push_back(argv[i]);
+        else patfile_name = argv[i];
+    }
+    if (bank_files.empty() || bank_files.size() > 2) {
+        cout << "Error: expected one or two .syx bank files" << endl;
+        return 1;
+    }
+
+    // Parse every bank dump in the given files in order. A file may hold both banks back to back, like
+    // pipe mode writes them. The first bank becomes bank A of the patch resource, the second bank B.
+    RawBank data[2];
+    int nBanks = 0;
+    for (const string& bank_file : bank_files) {
+        char sysex[BANK_SYSEX_SIZE * 2 + 1];
+        ifstream in_file(bank_file, ios::binary);
+        if (!in_file.good()) {
+            cout << "Error: file " << bank_file << " not found" << endl;
+            return 1;
+        }
+        in_file.read(sysex, sizeof(sysex));
+        size_t length = static_cast<size_t>(in_file.gcount());
+        in_file.close();
+
+        for (size_t pos = 0; pos < length; pos += BANK_SYSEX_SIZE) {
+            int bank = 0;
+            PatchError error = (nBanks < 2) ? parse_bank(sysex + pos, length - pos, data[nBanks], bank) : PatchError::InvalidSysex;
+            if (error != PatchError::None) {
+                cout << "Error: " << bank_file << " at offset " << pos << ": " << patch_error_message(error) << endl;
+                return 1;
             }
-            checksum = ((~(checksum & 0xFF)) + 1) & 0x7F;
-            (*splitData2).push_back(checksum);
-        }
-    }
-}
-
-void write_to_file(vector<char> splitData1, const char* output_bank1, vector<char>* splitData2, const char* output_bank2) {
-    // Open the output file in binary mode for writing
-    ofstream out_file1(output_bank1, ios::binary);
-    
-    //////////////////////////////////////////////////////////////////////////////////////////
-    //  The format of the FB-01 bank sysex files we must create is structured like so:      //
-    //                                                                                      //
-    //  For bank A:                                                                         //
-    //  $00-                                                                                //
-    //   $06:   F0 43 75 00 00 00 00h.......FB-01's "send bank A" sysex code                //
-    //--------------------------------------------------------------------------------------//
-    //  For bank B:                                                                         //
-    //  $00-                                                                                //
-    //   $06:   F0 43 75 00 00 00 01h.......FB-01's "send bank B" sysex code                //
-    //--------------------------------------------------------------------------------------//
-    //  $07-                                                                                //
-    //   $08:   00 40h......................Bank info packet size (64)                      //
-    //  $19-                                                                                //
-    //   $48:   <bank description>..........8-byte string for name + reserved empty bytes   //
-    //  $49 :   Checksum....................2's complement of sum                           //
-    //  $4A-                                                                                //
-    //   $4B:   01 00h......................Bank voice #1 packet size (128)                 //         
-    //  $4C-                                                                                //
-    //   $CB:   <patch data>................Voice #1 patch data                             //
-    //  $CC :   Checksum....................2's complement of sum                           //
-    //    "          "                           "                                          //
-    //    "          "                           "                                          //
-    //    "     ....."......................Voice #48                                       // 
-    // $18DA:   F7h.........................End sysex                                       //
-    //                                                                                      //
-    //  The resulting files will each be exactly 6363 bytes long.                           //
-    //////////////////////////////////////////////////////////////////////////////////////////
-    
-    // Prepare an array for the whole header for the bank 1 output file
-    char bank1header[74] = { '\xF0', '\x43', '\x75', '\x00', '\x00', '\x00', '\x00', '\x00', '\x40', '\0' };
-    
-    // Prepare bank 1 info packet, pulling the name of the bank from the first output filename given.
-    // 
-    // WHEN TWO BANKS ARE BEING GENERATED:
-    // Only the first 7 char's of outfile1 are pulled from the filename. If it is less than 7 char's already,
-    // it fills the remaining spaces with 0x20 (space character) and the 8th character with a '1' (for bank 1).
-    //
-    // WHEN ONE BANK IS BEING GENERATED:
-    // Pull the first 8 char's of outfile1 from the filename. Again, if it is less than 8 char's already,
-    // fill the remaining spaces with 0x20 (space character).
-
-    char bank1InfoPacket[32] = { 0 };
-    char* bank1name = bank1InfoPacket;
-
-    int len = strlen(output_bank1);
-    
-    // If two banks, make label 7 char's long to make room in label for "1" (part 1), else make it full 8 char's
-    int bank_name_maxlen = (splitData2) ? 7 : 8; 
-    
-    strncpy(bank1name, output_bank1, bank_name_maxlen); // Copy up to 7 (or 8) characters from output_bank1 into bank1name
-    // Convert the bank name to uppercase
-    for (int i = 0; i < bank_name_maxlen; i++) {
-        bank1name[i] = toupper(bank1name[i]);
-    }
-    // If the length of output_bank1 is less than 7 (or 8), fill the remaining characters with spaces
-    if (len < bank_name_maxlen) {
-        memset(bank1name + len, 0x20, bank_name_maxlen - len);
-    }
-    // If two banks, set the 8th character to '1', signifying "part 1" in label
-    if (splitData2) bank1name[7] = '1';
-
-    // Now nibblize the packet which will double its length and be stored in bank1header
-    for (int i = 0; i < sizeof(bank1InfoPacket); i++) {
-        unsigned char high_nibble = (bank1InfoPacket[i] >> 4) & 0x0F; // extract high nibble
-        unsigned char low_nibble = bank1InfoPacket[i] & 0x0F; // extract low nibble
-
-        bank1header[9 + i * 2] = low_nibble; // write low nibble to even-indexed output array
-        bank1header[9 + i * 2 + 1] = high_nibble; // write high nibble to odd-indexed output array
-    }
-    // One final step, calculate the packet's checksum and store it at the end of the header in the last index
-    unsigned char checksum = 0;
-    for (int i = 0; i < 64; i++) {
-        checksum += static_cast<unsigned int>(bank1header[9 + i]); // Sum all the bytes in the packet together
-    }
-    checksum = ((~(checksum & 0xFF)) + 1) & 0x7F; // Drop all but the lowest 8 bits, flip the bits, add 1, then mask the lowest 7 bits for the correct checksum value
-    bank1header[73] = checksum;
-    
-    // Begin writing bank A sysex file
-    out_file1.seekp(0, ios::beg);
-    out_file1.write(reinterpret_cast<char*>(&bank1header), sizeof(bank1header)); // Write the header to outfile1
-    out_file1.write(splitData1.data(), splitData1.size()); // Write the already nibblized and checksummed voice data packets
-    out_file1.write("\xF7", 1); // Write the final closing byte to end the exclusive message
-    out_file1.close();
+            nBanks++;
+        }
+    }
 
+    // Without an output name, use the first bank file's name minus its extension and any "_a" suffix
+    if (patfile_name.empty()) {
+        patfile_name = bank_files[0].substr(0, bank_files[0].size() - 4);
+        if (has_extension(patfile_name, "_a")) patfile_name.resize(patfile_name.size() - 2);
+    }
+    if (filesystem::path(patfile_name).extension().empty()) patfile_name += ".pat";
+    if (!overwrite_check(patfile_name)) return 1;
 
-    //
-    // Now for bank 2's header and info packet (if being processed)
-    //
-    if (splitData2) {
-        ofstream out_file2(output_bank2, ios::binary);
+    char image[6148];
+    size_t length = build_patch(data[0], (nBanks == 2) ? &data[1] : nullptr, image);
+    WriteResult written = write_image(image, length, patfile_name.c_str());
+    if (written == WriteResult::Failed) {
+        cout << "Error: could not write " << patfile_name << endl;
+        return 1;
+    }
+    if (written == WriteResult::Skipped) {
+        cout << patfile_name << " already exists, left untouched" << endl;
+        return 0;
+    }
+
+    cout << ((nBanks == 2) ? "Two bank" : "One bank") << " SCI patch resource " << patfile_name << " successfully created!" << endl;
+    return 0;
+}
+
+int run_game(int argc, char* argv[]) {
+    if (argc != 1 && argc != 2) {
+        cout << "Error: expected a game directory or ZIP archive and an optional output_bank" << endl;
+        return 1;
+    }
+    string gamedir = argv[0];
+    bool isArchive = has_extension(gamedir, ".zip");
+
+    // Without an output_bank, name the banks after the game directory (or the archive, minus its extension)
+    error_code ec;
+    filesystem::path dir = filesystem::absolute(gamedir, ec).lexically_normal();
+    if (!dir.has_filename()) dir = dir.parent_path();
+    string output_bank = (argc == 2) ? argv[1] : (isArchive ? dir.stem() : dir.filename()).string();
+    if (output_bank.empty()) output_bank = "patch";
+
+    Stats::Clock::time_point start = stats.now();
+    char image[MAX_PATCH_SIZE + 1];
+    size_t length = 0;
+    string error;
+    ZipArchive archive;
+    ResourceSource source;
+    bool loaded = isArchive ? archive.open(gamedir, error) &&
+                                  load_archive_resource(archive, RESOURCE_TYPE_PATCH, FB01_PATCH_NUMBER, image, sizeof(image), length, source, error)
+                            : load_game_resource(gamedir, RESOURCE_TYPE_PATCH, FB01_PATCH_NUMBER, image, sizeof(image), length, source, error);
+    if (!loaded) {
+        cout << "Error: " << error << endl;
+        stats.add_file(false, 0, start);
+        return 1;
+    }
+    // The resource files' own I/O isn't counted, only the bytes of the patch resource they produced
+    stats.add_io(0, length, 0);
+    stats.lap(STAGE_READ, start);
+
+    // The log names the file the patch was read from, and a resource out of a volume its offset in it. Only a
+    // stand-alone patch file has a header to tell its variant by; a volume resource is laid out as one.
+    ostringstream name;
+    name << (isArchive ? gamedir + ":" : string()) << source.file;
+    if (source.inVolume) name << " at " << hex << uppercase << source.offset << "h";
+    string patfile_name = name.str();
+    PatchLayout layout;
+    if (source.inVolume) {
+        PatchError volumeError = volume_patch_layout(image, length, layout);
+        if (volumeError != PatchError::None) {
+            cout << "Error: the patch resource in " << patfile_name
+                 << ((volumeError == PatchError::InvalidSize) ? " is not 3072 or 6146 bytes long" : " has no bank separator bytes") << endl;
+            stats.add_file(false, 0, start);
+            return 1;
+        }
+    }
+    int nBanks = 0;
+    int result = convert_patch_image(image, length, patfile_name.c_str(), output_bank.c_str(), cout, false, &nBanks,
+                                     source.inVolume ? &layout : nullptr);
+    stats.add_file(result == 0, nBanks, start);
+    return result;
+}
+
+int run_voices(int argc, char* argv[]) {
+    // The voice list comes first, then the patch file and optional output name in any order with "--bank"
+    vector<int> voices;
+    if (argc < 2 || !parse_voice_list(argv[0], voices)) {
+        cout << "Error: expected a voice list (voice numbers 0-95, such as 3,17,60-64) and a patch file" << endl;
+        return 1;
+    }
+    bool asBank = false;
+    string patfile_name;
+    string output_name;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--bank") == 0) asBank = true;
+        else if (patfile_name.empty()) patfile_name = argv[i];
+        else output_name = argv[i];
+    }
+    if (!resolve_patfile(patfile_name)) {
+        cout << "Error: file " << patfile_name << " not found" << endl;
+        return 1;
+    }
+    if (asBank && voices.size() > VOICES_PER_BANK) {
+        cout << "Error: a bank holds at most " << VOICES_PER_BANK << " voices" << endl;
+        return 1;
+    }
+
+    // Only the two header bytes, the separator and the selected voice records are read; the size check
+    // comes from the directory entry
+    error_code ec;
+    uintmax_t length = filesystem::file_size(patfile_name, ec);
+    ifstream patfile(patfile_name, ios::binary);
+    char header[FORMAT_HEADER_SIZE] = {};
+    patfile.read(header, sizeof(header));
+    PatchLayout layout;
+    PatchError error = ec ? PatchError::InvalidSize : detect_patch_format(header, static_cast<size_t>(length), layout, options.raw);
+    int nBanks = layout.nBanks;
+    int nReads = 1;
+    if (error == PatchError::None && layout.separatorOffset != 0) {
+        char separator[2] = {};
+        patfile.seekg(layout.separatorOffset);
+        patfile.read(separator, sizeof(separator));
+        nReads++;
+        error = check_separator(separator);
+    }
+    if (error == PatchError::None && layout.paddingOffset != 0) {
+        char padding[PADDING_BLOCK_SIZE];
+        size_t paddingLength = static_cast<size_t>(length) - layout.paddingOffset;
+        patfile.seekg(layout.paddingOffset);
+        patfile.read(padding, paddingLength);
+        nReads++;
+        error = check_padding(padding, paddingLength);
+    }
+    if (error != PatchError::None) {
+        cout << "Error: " << patfile_name << ": " << patch_error_message(error) << endl;
+        return 1;
+    }
+
+    vector<char> data(voices.size() * VOICE_SIZE);
+    for (size_t i = 0; i < voices.size(); i++) {
+        if (voices[i] >= nBanks * VOICES_PER_BANK) {
+            cout << "Error: " << patfile_name << " only has " << nBanks * VOICES_PER_BANK << " voices" << endl;
+            return 1;
+        }
+        patfile.seekg(voice_offset(layout, voices[i]));
+        patfile.read(data.data() + i * VOICE_SIZE, VOICE_SIZE);
+        nReads++;
+    }
+    patfile.close();
+    stats.add_io(nReads + 2, 2 + ((layout.separatorOffset != 0) ? 2 : 0) + ((layout.paddingOffset != 0) ? length - layout.paddingOffset : 0) + data.size(), 0);
+    if (patfile.fail()) {
+        cout << "Error: could not read " << patfile_name << endl;
+        return 1;
+    }
+
+    // Without an output name, the voices go next to the patch file
+    bool toStdout = (output_name == "-");
+    if (output_name.empty()) output_name = filesystem::path(patfile_name).replace_extension().string() + "_voices.syx";
+    else if (!toStdout && filesystem::path(output_name).extension().empty()) output_name += ".syx";
+    if (!toStdout && !overwrite_check(output_name)) return 1;
+
+    // Either a new bank with the voices in its first slots (the rest left empty), labelled like any other
+    // bank from its output name, or one "voice data to instrument" message per voice for instruments 1-8
+    vector<char> out;
+    if (asBank) {
+        RawBank bank = {};
+        memcpy(bank.data(), data.data(), data.size());
+        SysexBank sysex;
+        nibblize_data(bank, sysex);
+        build_bank_header(sysex, 0, output_name.c_str(), false);
+        out.assign(sysex.begin(), sysex.end());
+    }
+    else {
+        VoiceSysex message;
+        for (size_t i = 0; i < voices.size(); i++) {
+            build_voice_message(data.data() + i * VOICE_SIZE, static_cast<int>(i % 8), message);
+            out.insert(out.end(), message.begin(), message.end());
+        }
+    }
+
+    bool written = toStdout ? write_stdout(out.data(), out.size()) : (write_image(out.data(), out.size(), output_name.c_str()) != WriteResult::Failed);
+    if (!written) {
+        cout << "Error: could not write " << output_name << endl;
+        return 1;
+    }
+    if (!toStdout) cout << voices.size() << " voice(s) extracted to " << output_name << endl;
+    return 0;
+}
+
+bool parse_voice_list(const char* list, vector<int>& voices) {
+    // Comma separated voice numbers and ranges, such as "3,17,60-64"
+    const char* pos = list;
+    while (*pos) {
+        char* end = nullptr;
+        long first = strtol(pos, &end, 10);
+        if (end == pos) return false;
+        long last = first;
+        if (*end == '-') {
+            pos = end + 1;
+            last = strtol(pos, &end, 10);
+            if (end == pos) return false;
+        }
+        if (first < 0 || last < first || last >= 2 * VOICES_PER_BANK) return false;
+        for (long v = first; v <= last; v++) voices.push_back(static_cast<int>(v));
+        if (*end == ',') end++;
+        else if (*end) return false;
+        pos = end;
+    }
+    return !voices.empty();
+}
+
+int run_check(int argc, char* argv[]) {
+    vector<string> inputs;
+    int nMissing = 0;
+    for (int i = 0; i < argc; i++) collect_batch_inputs(argv[i], inputs, nMissing);
+    if (inputs.empty()) {
+        cout << "Error: no patch files to check" << endl;
+        return 1;
+    }
+
+    int nValid = 0;
+    for (const string& input : inputs) {
+        PatchLayout layout;
+        PatchError error = PatchError::None;
+        if (!check_patch_file(input.c_str(), layout, error)) {
+            cout << input << ": Error: could not read the file" << endl;
+        }
+        else if (error == PatchError::None) {
+            nValid++;
+            cout << input << ": valid, " << layout.nBanks << ((layout.nBanks == 2) ? " banks" : " bank");
+            if (layout.format != PatchFormat::Sci0) cout << " (" << patch_format_name(layout.format) << ")";
+            cout << endl;
+        }
+        else {
+            cout << input << ": " << patch_error_message(error) << endl;
+        }
+    }
 
-        char bank2header[74] = { '\xF0', '\x43', '\x75', '\x00', '\x00', '\x00', '\x01', '\x00', '\x40', '\0' };
-        char bank2InfoPacket[32] = { 0 };
-        char* bank2name = bank2InfoPacket;
+    cout << "---------------------------------" << endl;
+    cout << nValid << " of " << (inputs.size() + nMissing) << " files are valid FB-01 patch resources" << endl;
+    return (nValid == static_cast<int>(inputs.size()) && nMissing == 0) ? 0 : 1;
+}
+
+bool check_patch_file(const char* filename, PatchLayout& layout, PatchError& error) {
+    // The same checks as a conversion, from the header bytes, the file size, the separator and any padding alone.
+    // Unbuffered, so each check is a single small read and nothing is allocated for the file. Returns false
+    // when the file can't be opened or read at all, as opposed to read and found invalid.
+    FILE* file = fopen(filename, "rb");
+    if (!file) return false;
+    setvbuf(file, nullptr, _IONBF, 0);
+
+    char header[FORMAT_HEADER_SIZE] = {};
+    size_t nRead = fread(header, 1, sizeof(header), file);
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    if (length < 0 || nRead != min(sizeof(header), static_cast<size_t>(length))) {
+        fclose(file);
+        return false;
+    }
+    error = detect_patch_format(header, length, layout, options.raw);
+    int nCalls = 4;
+    size_t nBytes = nRead;
+    if (error == PatchError::None && layout.separatorOffset != 0) {
+        char separator[2] = {};
+        fseek(file, static_cast<long>(layout.separatorOffset), SEEK_SET);
+        nRead = fread(separator, 1, sizeof(separator), file);
+        error = (nRead == sizeof(separator)) ? check_separator(separator) : PatchError::MissingSeparator;
+        nCalls += 2;
+        nBytes += nRead;
+    }
+    if (error == PatchError::None && layout.paddingOffset != 0) {
+        char padding[PADDING_BLOCK_SIZE];
+        size_t paddingLength = static_cast<size_t>(length) - layout.paddingOffset;
+        fseek(file, static_cast<long>(layout.paddingOffset), SEEK_SET);
+        nRead = fread(padding, 1, paddingLength, file);
+        error = (nRead == paddingLength) ? check_padding(padding, paddingLength) : PatchError::InvalidSize;
+        nCalls += 2;
+        nBytes += nRead;
+    }
+    fclose(file);
+    stats.add_io(nCalls, nBytes, 0);
+    return true;
+}
 
-        len = strlen(output_bank2);
-        strncpy(bank2name, output_bank2, 7); // Copy up to 7 characters from output_bank2 into bank2name
-        // Convert the bank name to uppercase
-        for (int i = 0; i < 7; i++) {
-            bank2name[i] = toupper(bank2name[i]);
+int run_verify(int argc, char* argv[]) {
+    unsigned nThreads = thread::hardware_concurrency();
+    vector<string> inputs;
+    int nMissing = 0;
+    for (int i = 0; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0) && i + 1 < argc) {
+            nThreads = static_cast<unsigned>(atoi(argv[++i]));
+            continue;
         }
-        // If the length of output_bank2 is less than 7, fill the remaining characters with spaces
-        if (len < 7) {
-            memset(bank2name + len, 0x20, 7 - len);
+        collect_batch_inputs(argv[i], inputs, nMissing, is_bank_file);
+    }
+    if (inputs.empty()) {
+        cout << "Error: no .syx files to verify" << endl;
+        return 1;
+    }
+    if (nThreads == 0) nThreads = 1;
+    if (nThreads > inputs.size()) nThreads = static_cast<unsigned>(inputs.size());
+
+    // Each worker maps its next file and checks every bank dump in it in place. Only failures are printed.
+    atomic<size_t> next(0);
+    atomic<size_t> nBanks(0);
+    atomic<size_t> nBadPackets(0);
+    atomic<int> nBadFiles(nMissing);
+
+    auto worker = [&]() {
+        MappedFile file;
+        for (size_t i = next++; i < inputs.size(); i = next++) {
+            ostringstream log;
+            if (!file.open(inputs[i])) {
+                log << inputs[i] << ": Error: could not read the file" << endl;
+            }
+            else if (file.size() == 0) {
+                log << inputs[i] << ": Error: empty file" << endl;
+            }
+            else {
+                // A file may hold several bank dumps back to back, like --format syx writes them
+                for (size_t pos = 0; pos < file.size(); pos += BANK_SYSEX_SIZE) {
+                    size_t badOffsets[VOICES_PER_BANK + 1];
+                    int nBad = verify_bank(file.data() + pos, file.size() - pos, badOffsets, VOICES_PER_BANK + 1);
+                    if (nBad < 0) {
+                        log << inputs[i] << ": offset " << pos << ": " << patch_error_message(PatchError::InvalidSysex) << endl;
+                        break;
+                    }
+                    nBanks++;
+                    nBadPackets += nBad;
+                    for (int b = 0; b < nBad; b++) {
+                        size_t offset = pos + badOffsets[b];
+                        log << inputs[i] << ": offset " << offset << ": "
+                            << ((badOffsets[b] < BANK_HEADER_SIZE) ? "info packet" : "voice packet ")
+                            << ((badOffsets[b] < BANK_HEADER_SIZE) ? string() : to_string((badOffsets[b] - BANK_HEADER_SIZE) / VOICE_PACKET_SIZE + 1))
+                            << " " << patch_error_message(PatchError::BadChecksum) << endl;
+                    }
+                }
+            }
+            file.close();
+            if (log.tellp() == 0) continue;
+            nBadFiles++;
+            lock_guard<mutex> lock(console_mutex);
+            cout << log.str();
         }
-        bank2name[7] = '2'; // Set the 8th character to '2' (bank 2)
+    };
+
+    vector<thread> pool;
+    for (unsigned t = 0; t < nThreads; t++) pool.emplace_back(worker);
+    for (thread& t : pool) t.join();
+
+    cout << "---------------------------------" << endl;
+    cout << (inputs.size() + nMissing - nBadFiles) << " of " << (inputs.size() + nMissing) << " files verified, "
+         << nBanks << " banks checked, " << nBadPackets << " bad packets" << endl;
+    return (nBadFiles == 0) ? 0 : 1;
+}
+
+int run_watch(int argc, char* argv[]) {
+    string dir;
+    int quietMs = 250;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "--debounce") == 0 && i + 1 < argc) quietMs = atoi(argv[++i]);
+        else dir = argv[i];
+    }
+    if (dir.empty()) {
+        cout << "Error: expected a directory to watch" << endl;
+        return 1;
+    }
+
+    DirectoryWatcher watcher;
+    string error;
+    if (!watcher.open(dir, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+
+    // Nobody is there to answer the overwrite prompt
+    if (options.overwrite == OverwritePolicy::Ask) options.overwrite = OverwritePolicy::Force;
+
+    // The last seen contents of every patch file, so a change can be narrowed down to the bank it touched
+    unordered_map<string, vector<char>> images;
+    char image[MAX_PATCH_SIZE + 1];
+    error_code ec;
+    for (const auto& entry : filesystem::recursive_directory_iterator(dir, ec)) {
+        string name = entry.path().string();
+        if (!entry.is_regular_file(ec) || !is_patch_file(name)) continue;
+        streamoff length = read_image(name.c_str(), image, sizeof(image));
+        if (length >= 0) images[name].assign(image, image + length);
+    }
+    cout << "Watching " << dir << " (" << images.size() << " patch files), press Ctrl+C to stop" << endl;
+
+    vector<string> changed;
+    while (watcher.wait(changed, quietMs)) {
+        for (const string& name : changed) {
+            if (!is_patch_file(name)) continue;
+            streamoff length = read_image(name.c_str(), image, sizeof(image));
+            if (length < 0) continue;
+
+            // Work out which banks changed since the last conversion. A file that changed size (or a new one)
+            // is converted whole; otherwise each bank's voices are compared with what was there before. When
+            // both banks share one output file, any change rewrites the whole file.
+            vector<char>& previous = images[name];
+            PatchLayout layout;
+            bool valid = find_patch_layout(image, length, layout, options.raw) == PatchError::None;
+            int nBanks = valid ? layout.nBanks : 0;
+            bool changedA = true;
+            bool changedB = true;
+            if (valid && previous.size() == static_cast<size_t>(length)) {
+                size_t start = layout.voiceOffset[0];
+                size_t startB = layout.voiceOffset[1];
+                changedA = memcmp(image + start, previous.data() + start, RawBank().size()) != 0;
+                changedB = (nBanks == 2) && memcmp(image + startB, previous.data() + startB, RawBank().size()) != 0;
+            }
+            previous.assign(image, image + length);
+
+            ostringstream log;
+            if (!changedA && !changedB) log << "voices unchanged" << endl;
+            else if (nBanks != 2 || (changedA && changedB) || options.format != OutputFormat::Split) convert_patch_image(image, length, name.c_str(), name.c_str(), log);
+            else convert_one_bank(image, layout, name.c_str(), changedA ? 0 : 1, log);
+            cout << name << ": " << log.str() << flush;
+        }
+    }
+    cout << "Error: stopped watching " << dir << endl;
+    return 1;
+}
+
+int run_serve(int argc, char* argv[]) {
+    // Number of worker threads, defaults to one per hardware core
+    unsigned nThreads = thread::hardware_concurrency();
+    string address;
+    for (int i = 0; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0) && i + 1 < argc) nThreads = static_cast<unsigned>(atoi(argv[++i]));
+        else address = argv[i];
+    }
+    if (address.empty()) {
+        cout << "Error: expected a socket or port to listen on" << endl;
+        return 1;
+    }
+
+    ConversionServer server;
+    string error;
+    if (!server.open(address, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    if (nThreads == 0) nThreads = 1;
+    cout << "Serving on " << address << " with " << nThreads << " threads, press Ctrl+C to stop" << endl;
+    server.run(nThreads, options.raw);
+    return 0;
+}
+
+int convert_one_bank(const char* image, const PatchLayout& layout, const char* output_bank_name, int bank, ostream& log) {
+    // Rebuilds a single bank of an already validated two bank patch, named and labelled the same way
+    // convert_patch_image names and labels it
+    string output_bank = output_bank_name;
+    size_t ext_pos = output_bank.rfind('.');
+    if (ext_pos != string::npos) output_bank.resize(ext_pos);
+    output_bank += (bank == 0) ? "_a.syx" : "_b.syx";
+
+    RawBank data1;
+    RawBank data2;
+    read_patch(image, layout, data1, &data2);
+    const RawBank& data = (bank == 0) ? data1 : data2;
+    SysexBank splitData;
+    nibblize_data(data, splitData);
+    build_bank_header(splitData, bank, output_bank.c_str(), true);
+
+    WriteResult written = WriteResult::Written;
+    if (midi_out.is_open()) written = midi_out.send_bank(splitData, options.pacing) ? WriteResult::Written : WriteResult::Failed;
+    else written = write_image(splitData.data(), splitData.size(), output_bank.c_str());
+    if (written == WriteResult::Failed) {
+        log << "Error: could not write " << output_bank << endl;
+        return 1;
+    }
+    if (!options.voiceStore.empty() && !voice_store.add_bank(data, output_bank_name, bank)) {
+        log << "Error: could not add the voices to " << options.voiceStore << endl;
+        return 1;
+    }
+
+    log << "Only bank " << ((bank == 0) ? 'A' : 'B') << " changed, " << output_bank << " updated" << endl;
+    return 0;
+}
+
+int run_voice_users(int argc, char* argv[]) {
+    if (argc != 2) {
+        cout << "Error: expected a voice store directory and a voice hash" << endl;
+        return 1;
+    }
+    VoiceHash hash = strtoull(argv[1], nullptr, 16);
+
+    vector<string> users;
+    string error;
+    if (!VoiceStore::find_voice_users(argv[0], hash, users, error)) {
+        cout << "Error: " << error << endl;
+        return 1;
+    }
+    for (const string& user : users) cout << user << endl;
+    cout << users.size() << " bank(s) use voice " << argv[1] << endl;
+    return 0;
+}
+
+int run_similar(int argc, char* argv[]) {
+    size_t count = 20;
+    vector<const char*> args;
+    for (int i = 0; i < argc; i++) {
+        if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) count = static_cast<size_t>(atoi(argv[++i]));
+        else args.push_back(argv[i]);
+    }
+    if (args.size() != 2 && args.size() != 3) {
+        cout << "Error: expected a voice store directory and a voice hash, or a source file and voice number" << endl;
+        return 1;
+    }
+    filesystem::path dir = args[0];
 
-        // Nibblize bank 2's info packet
-        for (int i = 0; i < sizeof(bank2InfoPacket); i++) {
-            unsigned char high_nibble = (bank2InfoPacket[i] >> 4) & 0x0F;
-            unsigned char low_nibble = bank2InfoPacket[i] & 0x0F;
+    // Decode every stored voice into the parameter store, hashing them on the way so the query and the
+    // results can be matched up with the banks that use them
+    MappedFile voices_file;
+    if (!voices_file.open((dir / "VOICES.BIN").string())) {
+        cout << "Error: no voice store in " << args[0] << endl;
+        return 1;
+    }
+    size_t nVoices = voices_file.size() / VOICE_SIZE;
+    VoiceParamStore params;
+    params.reserve(nVoices);
+    unordered_map<VoiceHash, size_t> positions;
+    vector<VoiceHash> hashes(nVoices);
+    for (size_t i = 0; i < nVoices; i++) {
+        const char* voice = voices_file.data() + i * VOICE_SIZE;
+        params.add(voice);
+        hashes[i] = hash_voice(voice);
+        positions.emplace(hashes[i], i);
+    }
 
-            bank2header[9 + i * 2] = low_nibble;
-            bank2header[9 + i * 2 + 1] = high_nibble;
+    // Where each voice was first seen, as "source voice", and the query's hash when it's given by source
+    unordered_map<VoiceHash, string> first_users;
+    VoiceHash query = 0;
+    bool found = false;
+    if (args.size() == 2) {
+        query = strtoull(args[1], nullptr, 16);
+        found = true;
+    }
+    int query_voice = (args.size() == 3) ? atoi(args[2]) : -1;
+    ifstream banks_in(dir / "BANKS.TXT");
+    string line;
+    while (getline(banks_in, line)) {
+        size_t source_end = line.find('\t');
+        if (source_end == string::npos || source_end + 3 > line.size()) continue;
+        string source = line.substr(0, source_end);
+        int bank = line[source_end + 1] - 'A';
+        istringstream bank_hashes(line.substr(source_end + 3));
+        string hex;
+        for (int v = 0; v < VOICES_PER_BANK && bank_hashes >> hex; v++) {
+            VoiceHash hash = strtoull(hex.c_str(), nullptr, 16);
+            int voice = bank * VOICES_PER_BANK + v;
+            if (!found && source == args[1] && voice == query_voice) {
+                query = hash;
+                found = true;
+            }
+            first_users.emplace(hash, source + " " + to_string(voice));
         }
-        // Calculate and store bank 2's checksum
-        checksum = 0;
-        for (int i = 0; i < 64; i++) {
-            checksum += static_cast<unsigned int>(bank2header[9 + i]);
+    }
+
+    auto query_pos = positions.find(query);
+    if (!found || query_pos == positions.end()) {
+        cout << "Error: voice " << args[1] << (args.size() == 3 ? string(" ") + args[2] : string()) << " is not in the voice store" << endl;
+        return 1;
+    }
+
+    // The 7-character voice name in the first bytes of the voice data
+    auto voice_name = [&](size_t i) {
+        string name(voices_file.data() + i * VOICE_SIZE, 7);
+        for (char& c : name) {
+            if (c < 0x20 || c > 0x7E) c = ' ';
         }
-        checksum = ((~(checksum & 0xFF)) + 1) & 0x7F;
-        bank2header[73] = checksum;
-   
-        // Begin writing bank B sysex file
-        out_file2.seekp(0, ios::beg);
-        out_file2.write(reinterpret_cast<char*>(&bank2header), sizeof(bank2header));
-        out_file2.write((*splitData2).data(), (*splitData2).size());
-        out_file2.write("\xF7", 1);
-        out_file2.close();
+        return name;
+    };
+
+    vector<VoiceMatch> matches;
+    params.nearest(query_pos->second, count, matches);
+    cout << "Voices most like " << hex << setw(16) << setfill('0') << query << dec << setfill(' ')
+         << " \"" << voice_name(query_pos->second) << "\" out of " << nVoices << " stored voices:" << endl;
+    for (const VoiceMatch& match : matches) {
+        cout << setw(6) << match.distance << "  " << hex << setw(16) << setfill('0') << hashes[match.voice] << dec << setfill(' ')
+             << "  \"" << voice_name(match.voice) << "\"  " << first_users[hashes[match.voice]] << endl;
     }
+    return 0;
 }
 
-bool check_file_exists(const char* filename) {
-    ifstream infile(filename);
-    return infile.good();
+int run_build_bank(int argc, char* argv[]) {
+    if (argc != 1 && argc != 2) {
+        cout << "Error: expected a manifest and an optional output_bank" << endl;
+        return 1;
+    }
+    ifstream manifest(argv[0]);
+    if (!manifest.good()) {
+        cout << "Error: manifest " << argv[0] << " not found" << endl;
+        return 1;
+    }
+
+    // Each line names one voice, in bank slot order: a voice hash from the voice store, or a patch file or
+    // .syx bank dump and a voice number in it. Blank lines and lines starting with '#' are skipped.
+    struct VoiceRef {
+        string source;
+        int voice;
+        VoiceHash hash;
+        int line;
+    };
+    vector<VoiceRef> refs;
+    string line;
+    for (int lineNumber = 1; getline(manifest, line); lineNumber++) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        size_t start = line.find_first_not_of(" \t");
+        if (start == string::npos || line[start] == '#') continue;
+        size_t end = line.find_last_not_of(" \t");
+        size_t split = line.find_last_of(" \t", end);
+        VoiceRef ref = { string(), -1, 0, lineNumber };
+        if (split == string::npos || split < start) {
+            ref.hash = strtoull(line.c_str() + start, nullptr, 16);
+        }
+        else {
+            ref.source = line.substr(start, line.find_last_not_of(" \t", split) + 1 - start);
+            ref.voice = atoi(line.c_str() + split + 1);
+        }
+        refs.push_back(ref);
+    }
+    if (refs.empty() || refs.size() > 2 * VOICES_PER_BANK) {
+        cout << "Error: a manifest lists 1 to " << 2 * VOICES_PER_BANK << " voices, " << argv[0] << " has " << refs.size() << endl;
+        return 1;
+    }
+
+    // Up to 48 voices make one bank and up to 96 make two. Slots not filled are left empty.
+    int nBanks = (refs.size() > VOICES_PER_BANK) ? 2 : 1;
+    RawBank data[2] = {};
+    auto slot = [&](size_t i) { return (i < VOICES_PER_BANK) ? data[0].data() + i * VOICE_SIZE : data[1].data() + (i - VOICES_PER_BANK) * VOICE_SIZE; };
+
+    // Voices from files: each file is read and checked once, however many of its voices are used
+    unordered_map<string, vector<RawBank>> sources;
+    for (size_t i = 0; i < refs.size(); i++) {
+        const VoiceRef& ref = refs[i];
+        if (ref.source.empty()) continue;
+        auto source = sources.find(ref.source);
+        if (source == sources.end()) {
+            vector<RawBank> banks;
+            string error;
+            if (!load_voice_source(ref.source, banks, error)) {
+                cout << "Error: " << argv[0] << " line " << ref.line << ": " << error << endl;
+                return 1;
+            }
+            source = sources.emplace(ref.source, move(banks)).first;
+        }
+        int nVoices = static_cast<int>(source->second.size()) * VOICES_PER_BANK;
+        if (ref.voice < 0 || ref.voice >= nVoices) {
+            cout << "Error: " << argv[0] << " line " << ref.line << ": " << ref.source << " has voices 0 to " << (nVoices - 1) << endl;
+            return 1;
+        }
+        memcpy(slot(i), source->second[ref.voice / VOICES_PER_BANK].data() + (ref.voice % VOICES_PER_BANK) * VOICE_SIZE, VOICE_SIZE);
+    }
+
+    // Voices by hash come straight out of the voice store's memory-mapped VOICES.BIN. One pass over the
+    // mapped VOICES.IDX finds every one of them, with no index built in memory. An index that doesn't
+    // cover VOICES.BIN exactly (which the next --store run rebuilds) is passed over for hashing the voices.
+    unordered_map<VoiceHash, vector<size_t>> wanted;
+    for (size_t i = 0; i < refs.size(); i++) {
+        if (refs[i].source.empty()) wanted[refs[i].hash].push_back(i);
+    }
+    if (!wanted.empty()) {
+        if (options.voiceStore.empty()) {
+            cout << "Error: voices given by hash need a voice store (--store storedir)" << endl;
+            return 1;
+        }
+        filesystem::path dir = options.voiceStore;
+        MappedFile voices_file;
+        MappedFile index_file;
+        if (!voices_file.open((dir / "VOICES.BIN").string())) {
+            cout << "Error: no voice store in " << options.voiceStore << endl;
+            return 1;
+        }
+        size_t nStored = voices_file.size() / VOICE_SIZE;
+        bool indexed = index_file.open((dir / "VOICES.IDX").string()) && index_file.size() == nStored * 8;
+        const unsigned char* index = reinterpret_cast<const unsigned char*>(index_file.data());
+        size_t nFound = 0;
+        for (size_t v = 0; v < nStored && nFound < wanted.size(); v++) {
+            VoiceHash hash = 0;
+            if (indexed) {
+                for (int b = 0; b < 8; b++) hash |= static_cast<VoiceHash>(index[v * 8 + b]) << (b * 8);
+            }
+            else {
+                hash = hash_voice(voices_file.data() + v * VOICE_SIZE);
+            }
+            auto entry = wanted.find(hash);
+            if (entry == wanted.end() || entry->second.empty()) continue;
+            for (size_t i : entry->second) memcpy(slot(i), voices_file.data() + v * VOICE_SIZE, VOICE_SIZE);
+            entry->second.clear();
+            nFound++;
+        }
+        for (size_t i = 0; i < refs.size(); i++) {
+            if (!refs[i].source.empty() || wanted[refs[i].hash].empty()) continue;
+            cout << "Error: " << argv[0] << " line " << refs[i].line << ": voice " << hex << setw(16) << setfill('0') << refs[i].hash
+                 << dec << setfill(' ') << " is not in the voice store" << endl;
+            return 1;
+        }
+    }
+
+    // The banks are named and labelled like any converted patch, and the patch resource goes with them
+    string output_bank = (argc == 2) ? argv[1] : argv[0];
+    output_bank = filesystem::path(output_bank).replace_extension().string();
+    string output_bank1 = output_bank + ((nBanks == 2) ? "_a.syx" : ".syx");
+    string output_bank2 = output_bank + "_b.syx";
+    string patfile_name = output_bank + ".pat";
+    if (!overwrite_check(output_bank1) || (nBanks == 2 && !overwrite_check(output_bank2)) || !overwrite_check(patfile_name)) return 1;
+
+    SysexBank splitData1;
+    SysexBank splitData2;
+    nibblize_data(data[0], splitData1);
+    build_bank_header(splitData1, 0, output_bank1.c_str(), nBanks == 2);
+    if (nBanks == 2) {
+        nibblize_data(data[1], splitData2);
+        build_bank_header(splitData2, 1, output_bank2.c_str(), true);
+    }
+    char image[6148];
+    size_t length = build_patch(data[0], (nBanks == 2) ? &data[1] : nullptr, image);
+
+    WriteResult written = write_to_file(splitData1, output_bank1.c_str(), (nBanks == 2) ? &splitData2 : nullptr, output_bank2.c_str());
+    WriteResult patchWritten = (written == WriteResult::Failed) ? WriteResult::Failed : write_image(image, length, patfile_name.c_str());
+    if (written == WriteResult::Failed || patchWritten == WriteResult::Failed) {
+        cout << "Error: could not write the bank for " << argv[0] << endl;
+        return 1;
+    }
+    string outputs = (nBanks == 2) ? output_bank1 + " / " + output_bank2 : output_bank1;
+    cout << refs.size() << " voice(s) from " << argv[0] << " built into " << outputs << " and " << patfile_name << endl;
+    return 0;
+}
+
+bool load_voice_source(const string& filename, vector<RawBank>& banks, string& error) {
+    // A .syx file holds one or two bank dumps, with every packet's checksum verified; anything else is a
+    // patch resource
+    char image[BANK_SYSEX_SIZE * 2 + 1];
+    streamoff length = read_image(filename.c_str(), image, sizeof(image));
+    if (length < 0) {
+        error = "file " + filename + " not found";
+        return false;
+    }
+    if (has_extension(filename, ".syx")) {
+        for (streamoff pos = 0; pos < length; pos += BANK_SYSEX_SIZE) {
+            RawBank data;
+            int bank = 0;
+            PatchError result = (banks.size() < 2) ? parse_bank(image + pos, static_cast<size_t>(length - pos), data, bank) : PatchError::InvalidSysex;
+            if (result != PatchError::None) {
+                error = filename + ": " + patch_error_message(result);
+                return false;
+            }
+            banks.push_back(data);
+        }
+        return true;
+    }
+
+    PatchLayout layout;
+    PatchError result = find_patch_layout(image, static_cast<size_t>(length), layout, options.raw);
+    if (result != PatchError::None) {
+        error = filename + ": " + patch_error_message(result);
+        return false;
+    }
+    banks.resize(layout.nBanks);
+    read_patch(image, layout, banks[0], (layout.nBanks == 2) ? &banks[1] : nullptr);
+    return true;
 }
 
-void overwrite_check(string output_filename) {
-    ifstream file(output_filename);
-    if (file.good()) {
+int run_bench(int argc, char* argv[]) {
+    double seconds = (argc >= 1) ? atof(argv[0]) : 0.5;
+    if (seconds <= 0) seconds = 0.5;
+
+    // Synthetic patch images laid out like the real thing: header, an 8 character title, the voices,
+    // and the separator bytes for the two bank patch
+    const int titleLength = 8;
+    char image1[3074 + titleLength];
+    char image2[6148 + titleLength];
+    unsigned int seed = 12345;
+    for (char* image : { image1, image2 }) {
+        size_t size = (image == image1) ? sizeof(image1) : sizeof(image2);
+        for (size_t i = 0; i < size; i++) {
+            seed = seed * 1103515245 + 12345;
+            image[i] = static_cast<char>(seed >> 16);
+        }
+        image[0] = '\x89';
+        image[1] = titleLength;
+        memcpy(image + 2, "BENCHMRK", titleLength);
+    }
+    image2[0xC02 + titleLength] = '\xAB';
+    image2[0xC03 + titleLength] = '\xCD';
+
+    RawBank data1;
+    RawBank data2;
+    SysexBank splitData1;
+    SysexBank splitData2;
+    int nBanks = 0;
+    volatile char sink = 0;
+
+    // Runs one stage repeatedly for the requested time and reports its throughput. "bytes" and "voices"
+    // are the amount of input a single run of the stage processes.
+    auto bench = [&](const char* name, size_t bytes, int voices, const function<void()>& stage) {
+        using clock = chrono::steady_clock;
+        long long iterations = 0;
+        clock::time_point start = clock::now();
+        clock::time_point end = start;
+        do {
+            for (int i = 0; i < 256; i++) stage();
+            iterations += 256;
+            end = clock::now();
+        } while (chrono::duration<double>(end - start).count() < seconds);
+        sink = sink + splitData1[100] + splitData2[100] + data1[10] + data2[10];
+
+        double elapsed = chrono::duration<double>(end - start).count();
+        cout << left << setw(28) << name << right
+             << setw(10) << elapsed * 1e9 / iterations << " ns"
+             << setw(12) << bytes * iterations / elapsed / 1e6 << " MB/s"
+             << setw(14) << voices * iterations / elapsed / 1e6 << " Mvoices/s" << endl;
+    };
+
+    // The read stage as conversions run it: classify the image, then copy the voices out through its layout
+    PatchLayout layout;
+    bench("read_patch (1 bank)", sizeof(image1), 48, [&]() {
+        find_patch_layout(image1, sizeof(image1), layout);
+        read_patch(image1, layout, data1);
+    });
+    bench("read_patch (2 banks)", sizeof(image2), 96, [&]() {
+        find_patch_layout(image2, sizeof(image2), layout);
+        read_patch(image2, layout, data1, &data2);
+    });
+    bench("nibblize_data (1 bank)", data1.size(), 48, [&]() { nibblize_data(data1, splitData1); });
+    bench("nibblize_data (2 banks)", data1.size() * 2, 96, [&]() {
+        nibblize_data(data1, splitData1);
+        nibblize_data(data2, splitData2);
+    });
+    bench("build_bank_header", BANK_HEADER_SIZE, 0, [&]() { build_bank_header(splitData1, 0, "bench_a.syx", true); });
+    bench("convert_patch (1 bank)", sizeof(image1), 48, [&]() {
+        convert_patch(image1, sizeof(image1), "bench.syx", splitData1, splitData2, nBanks);
+    });
+    bench("convert_patch (2 banks)", sizeof(image2), 96, [&]() {
+        convert_patch(image2, sizeof(image2), "bench_a.syx", splitData1, splitData2, nBanks, "bench_b.syx");
+    });
+    return 0;
+}
+
+// The self-test corpus: synthetic patches covering one and two banks, empty, short and 255 character titles,
+// and voices of all FFh (the largest checksum sums). The hashes are FNV-1a of the bank files the original
+// converter wrote for each, labelled "selftest".
+struct SelfTestPatch {
+    int titleLength;
+    bool twoBanks;
+    unsigned seed;              // Generates the patch bytes; 0 fills them with FFh instead
+    uint64_t hashA;
+    uint64_t hashB;
+};
+
+const SelfTestPatch SELF_TEST_CORPUS[] = {
+    { 0, false, 1, 0x5de3c020c3e7093c, 0 },
+    { 8, false, 2, 0x452025de130f6070, 0 },
+    { 255, false, 3, 0xb0ff8bb16e139ad8, 0 },
+    { 0, true, 4, 0x0ca2662c4be6f5d4, 0x1b67d236f519f563 },
+    { 8, true, 5, 0xc773fe44d3b0c302, 0x2520ac745b7b6fb9 },
+    { 255, true, 6, 0x057feb3bd7326238, 0xddaa49b1b9535199 },
+    { 3, true, 0, 0x0c7763f872c9e798, 0xc23f475287979859 },
+};
+
+uint64_t fnv1a(const char* data, size_t length) {
+    uint64_t hash = 0xcbf29ce484222325;
+    for (size_t i = 0; i < length; i++) hash = (hash ^ static_cast<unsigned char>(data[i])) * 0x100000001b3;
+    return hash;
+}
+
+size_t make_test_patch(const SelfTestPatch& patch, char* image) {
+    // The same generator as run_bench, with the header, title and separator put in afterwards
+    size_t size = (patch.twoBanks ? 6148 : 3074) + patch.titleLength;
+    unsigned int seed = patch.seed;
+    for (size_t i = 0; i < size; i++) {
+        seed = seed * 1103515245 + 12345;
+        image[i] = (patch.seed == 0) ? '\xFF' : static_cast<char>(seed >> 16);
+    }
+    image[0] = '\x89';
+    image[1] = static_cast<char>(patch.titleLength);
+    for (int i = 0; i < patch.titleLength; i++) image[2 + i] = static_cast<char>('A' + i % 26);
+    if (patch.twoBanks) {
+        image[0xC02 + patch.titleLength] = '\xAB';
+        image[0xC03 + patch.titleLength] = '\xCD';
+    }
+    return size;
+}
+
+PatchError reference_check(const char* image, size_t length, int& nBanks) {
+    // The patch checks as main() first made them, one byte at a time
+    if (length < 2 || static_cast<unsigned char>(image[0]) != 0x89) return PatchError::InvalidHeader;
+    size_t title = static_cast<unsigned char>(image[1]);
+    if (length == 3074 + title) {
+        nBanks = 1;
+        return PatchError::None;
+    }
+    if (length != 6148 + title) return PatchError::InvalidSize;
+    nBanks = 2;
+    if (static_cast<unsigned char>(image[0xC02 + title]) != 0xAB || static_cast<unsigned char>(image[0xC03 + title]) != 0xCD) {
+        return PatchError::MissingSeparator;
+    }
+    return PatchError::None;
+}
+
+bool packets_match(const char* voices, const SysexBank& bank) {
+    // Checks the voice packets of a generated bank against the original nibblizing loop: low nibble first,
+    // and a checksum of the 2's complement of the nibbles' sum, masked to 7 bits
+    for (int voice = 0; voice < VOICES_PER_BANK; voice++) {
+        const unsigned char* packet = reinterpret_cast<const unsigned char*>(bank.data() + BANK_HEADER_SIZE + voice * VOICE_PACKET_SIZE);
+        if (packet[0] != 0x01 || packet[1] != 0x00) return false;
+        unsigned int sum = 0;
+        for (int i = 0; i < VOICE_SIZE; i++) {
+            unsigned char byte = static_cast<unsigned char>(voices[voice * VOICE_SIZE + i]);
+            if (packet[2 + i * 2] != (byte & 0x0F) || packet[3 + i * 2] != (byte >> 4)) return false;
+            sum += (byte & 0x0F) + (byte >> 4);
+        }
+        if (packet[130] != ((~(sum & 0xFF) + 1) & 0x7F)) return false;
+    }
+    return static_cast<unsigned char>(bank.back()) == 0xF7;
+}
+
+bool file_matches(const string& filename, const SysexBank& bank) {
+    ifstream file(filename, ios::binary);
+    vector<char> contents((istreambuf_iterator<char>(file)), istreambuf_iterator<char>());
+    return contents.size() == bank.size() && equal(contents.begin(), contents.end(), bank.begin());
+}
+
+int run_self_test(int argc, char* argv[]) {
+    double minRate = (argc >= 1) ? atof(argv[0]) : 5.0;
+    int nFailed = 0;
+    auto report = [&](const string& name, bool passed, const string& detail = string()) {
+        cout << left << setw(36) << name << right << (passed ? "ok" : "FAILED") << detail << endl;
+        if (!passed) nFailed++;
+    };
+
+    // Golden outputs: every corpus patch converted in memory and through write_to_file, which must agree
+    // with each other, the original converter's hashes and the reference nibblizing. The banks are written
+    // to a scratch directory, but keep the labels they'd get written to the current one.
+    error_code ec;
+    filesystem::path dir = filesystem::temp_directory_path(ec) / ("sci2fb-selftest-" + to_string(random_device{}()));
+    filesystem::create_directories(dir, ec);
+    string fileA = (dir / "selftest_a.syx").string();
+    string fileB = (dir / "selftest_b.syx").string();
+    string fileSingle = (dir / "selftest.syx").string();
+    char image[MAX_PATCH_SIZE];
+    SysexBank splitData1;
+    SysexBank splitData2;
+    for (const SelfTestPatch& patch : SELF_TEST_CORPUS) {
+        size_t length = make_test_patch(patch, image);
+        int nBanks = 0;
+        PatchError result = convert_patch(image, length, patch.twoBanks ? "selftest_a.syx" : "selftest.syx", splitData1, splitData2,
+                                          nBanks, patch.twoBanks ? "selftest_b.syx" : nullptr);
+        const char* file = patch.twoBanks ? fileA.c_str() : fileSingle.c_str();
+
+        const char* voices = image + 2 + patch.titleLength;
+        bool converted = result == PatchError::None && nBanks == (patch.twoBanks ? 2 : 1);
+        bool golden = converted && fnv1a(splitData1.data(), splitData1.size()) == patch.hashA &&
+                      (!patch.twoBanks || fnv1a(splitData2.data(), splitData2.size()) == patch.hashB);
+        bool packets = converted && packets_match(voices, splitData1) &&
+                       (!patch.twoBanks || packets_match(voices + VOICES_PER_BANK * VOICE_SIZE + 2, splitData2));
+        bool written = converted &&
+                       write_to_file(splitData1, file, patch.twoBanks ? &splitData2 : nullptr, fileB.c_str()) != WriteResult::Failed &&
+                       file_matches(file, splitData1) && (!patch.twoBanks || file_matches(fileB, splitData2));
+
+        string name = string(patch.twoBanks ? "2 banks" : "1 bank") + ", title " + to_string(patch.titleLength) +
+                      (patch.seed == 0 ? ", FFh voices" : "");
+        report(name, golden && packets && written,
+               golden && packets && written ? "" : string(" (") + (!converted ? "rejected" : !golden ? "golden hash" : !packets ? "voice packets" : "written file") + ")");
+    }
+
+    // The other patch variants hold the same voices, so each must give the same banks as its SCI0 original:
+    // the voices alone (half the two bank dumps keeping the separator), and the patches padded out to a block
+    int nRaw = 0;
+    int nPadded = 0;
+    int nPaddable = 0;
+    for (const SelfTestPatch& patch : SELF_TEST_CORPUS) {
+        size_t length = make_test_patch(patch, image);
+        const char* voices = image + 2 + patch.titleLength;
+        size_t voicesLength = length - 2 - patch.titleLength;
+        bool withSeparator = patch.titleLength % 2 == 0;
+        vector<char> raw(voices, voices + voicesLength);
+        if (patch.twoBanks && !withSeparator) raw.erase(raw.begin() + VOICES_PER_BANK * VOICE_SIZE, raw.begin() + VOICES_PER_BANK * VOICE_SIZE + 2);
+        vector<char> padded(image, image + length);
+        padded.resize((length + PADDING_BLOCK_SIZE - 1) / PADDING_BLOCK_SIZE * PADDING_BLOCK_SIZE, '\x1A');
+        bool testPadded = padded.size() != length;
+        if (testPadded) nPaddable++;
+
+        const char* label = patch.twoBanks ? "selftest_a.syx" : "selftest.syx";
+        const char* labelB = patch.twoBanks ? "selftest_b.syx" : nullptr;
+        for (vector<char>* variant : { &raw, &padded }) {
+            if (variant == &padded && !testPadded) continue;
+            // Raw dumps are only taken when asked for, and must be turned down otherwise
+            bool isRaw = (variant == &raw);
+            int nBanks = 0;
+            PatchLayout layout;
+            bool same = find_patch_layout(variant->data(), variant->size(), layout, isRaw) == PatchError::None &&
+                        layout.format == (isRaw ? PatchFormat::Raw : PatchFormat::Padded) &&
+                        (!isRaw || find_patch_layout(variant->data(), variant->size(), layout) != PatchError::None) &&
+                        convert_patch(variant->data(), variant->size(), label, splitData1, splitData2, nBanks, labelB, isRaw) == PatchError::None &&
+                        fnv1a(splitData1.data(), splitData1.size()) == patch.hashA &&
+                        (!patch.twoBanks || fnv1a(splitData2.data(), splitData2.size()) == patch.hashB);
+            if (same && isRaw) nRaw++;
+            else if (same) nPadded++;
+        }
+    }
+    int nPatches = static_cast<int>(sizeof(SELF_TEST_CORPUS) / sizeof(SELF_TEST_CORPUS[0]));
+    report("raw voice dumps", nRaw == nPatches, " (" + to_string(nRaw) + " of " + to_string(nPatches) + ")");
+    report("padded patch resources", nPadded == nPaddable, " (" + to_string(nPadded) + " of " + to_string(nPaddable) + ")");
+
+    // Game volumes: each patch's voices stored headerless, as the interpreter keeps them, in a RESOURCE.001
+    // behind another resource, found through a RESOURCE.MAP and read back through the volume layout
+    int nVolume = 0;
+    for (size_t p = 0; p < sizeof(SELF_TEST_CORPUS) / sizeof(SELF_TEST_CORPUS[0]); p++) {
+        const SelfTestPatch& patch = SELF_TEST_CORPUS[p];
+        size_t length = make_test_patch(patch, image) - 2 - patch.titleLength;
+        const char* voices = image + 2 + patch.titleLength;
+        filesystem::path gamedir = dir / ("game" + to_string(p));
+        filesystem::create_directories(gamedir, ec);
+        const uint16_t id = (RESOURCE_TYPE_PATCH << 11) | FB01_PATCH_NUMBER;
+        const uint32_t offset = 16;
+        const unsigned char map[12] = { id & 0xFF, id >> 8, offset, 0, 0, 1 << 2, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF };
+        const unsigned char header[8] = { id & 0xFF, id >> 8, static_cast<unsigned char>((length + 4) & 0xFF), static_cast<unsigned char>((length + 4) >> 8),
+                                          static_cast<unsigned char>(length & 0xFF), static_cast<unsigned char>(length >> 8), 0, 0 };
+        ofstream(gamedir / "RESOURCE.MAP", ios::binary).write(reinterpret_cast<const char*>(map), sizeof(map));
+        ofstream volume(gamedir / "RESOURCE.001", ios::binary);
+        volume.write(string(offset, '\0').data(), offset);
+        volume.write(reinterpret_cast<const char*>(header), sizeof(header));
+        volume.write(voices, length);
+        volume.close();
+
+        char resource[MAX_PATCH_SIZE];
+        size_t resourceLength = 0;
+        ResourceSource source;
+        string error;
+        PatchLayout layout;
+        bool same = load_game_resource(gamedir.string(), RESOURCE_TYPE_PATCH, FB01_PATCH_NUMBER, resource, sizeof(resource), resourceLength, source, error) &&
+                    source.inVolume && source.offset == offset && resourceLength == length &&
+                    volume_patch_layout(resource, resourceLength, layout) == PatchError::None && layout.nBanks == (patch.twoBanks ? 2 : 1);
+        if (same) {
+            convert_patch(resource, layout, patch.twoBanks ? "selftest_a.syx" : "selftest.syx", splitData1, splitData2, patch.twoBanks ? "selftest_b.syx" : nullptr);
+            same = fnv1a(splitData1.data(), splitData1.size()) == patch.hashA && (!patch.twoBanks || fnv1a(splitData2.data(), splitData2.size()) == patch.hashB);
+        }
+        if (same) nVolume++;
+    }
+    filesystem::remove_all(dir, ec);
+    report("patch resources in game volumes", nVolume == nPatches, " (" + to_string(nVolume) + " of " + to_string(nPatches) + ")");
+
+    // Fuzzing: random images around the valid sizes, half with a real header and separator, run through both
+    // check_patch and the split header/separator checks against the reference. Fixed seed, so a failure repeats.
+    mt19937 rng(2023);
+    int nMismatches = 0;
+    int nValid = 0;
+    vector<char> fuzzed;
+    for (int i = 0; i < 200000; i++) {
+        size_t title = rng() % 256;
+        size_t sizes[] = { 3074 + title, 6148 + title, 3073 + title, 6149 + title, rng() % 4, rng() % (MAX_PATCH_SIZE + 2) };
+        fuzzed.resize(sizes[rng() % 6]);
+        for (char& c : fuzzed) c = static_cast<char>(rng());
+        if (fuzzed.size() >= 2 && rng() % 2) {
+            fuzzed[0] = '\x89';
+            fuzzed[1] = static_cast<char>(title);
+            if (fuzzed.size() == 6148 + title && rng() % 4) {
+                fuzzed[0xC02 + title] = '\xAB';
+                fuzzed[0xC03 + title] = '\xCD';
+            }
+        }
+
+        int expectedBanks = 0;
+        int nBanks = 0;
+        int headerBanks = 0;
+        PatchError expected = reference_check(fuzzed.data(), fuzzed.size(), expectedBanks);
+        PatchError result = check_patch(fuzzed.data(), fuzzed.size(), nBanks);
+        PatchError split = check_patch_header(fuzzed.data(), fuzzed.size(), headerBanks);
+        if (split == PatchError::None && headerBanks == 2) {
+            split = check_separator(fuzzed.data() + separator_offset(static_cast<unsigned char>(fuzzed[1])));
+        }
+        bool match = result == expected && split == expected && (expected != PatchError::None || nBanks == expectedBanks);
+
+        // Whatever passes has to convert, with the same voice packets the reference makes
+        if (match && expected == PatchError::None) {
+            nValid++;
+            const char* voices = fuzzed.data() + 2 + static_cast<unsigned char>(fuzzed[1]);
+            match = convert_patch(fuzzed.data(), fuzzed.size(), "fuzz_a.syx", splitData1, splitData2, nBanks, "fuzz_b.syx") == PatchError::None &&
+                    packets_match(voices, splitData1) && (nBanks == 1 || packets_match(voices + VOICES_PER_BANK * VOICE_SIZE + 2, splitData2));
+        }
+        if (!match) nMismatches++;
+    }
+    report("patch checks (200000 fuzzed)", nMismatches == 0,
+           " (" + to_string(nValid) + " valid" + (nMismatches ? ", " + to_string(nMismatches) + " mismatched" : "") + ")");
+
+    // Throughput: whole two bank conversions, against the minimum given on the command line
+    size_t length = make_test_patch(SELF_TEST_CORPUS[3], image);
+    int nBanks = 0;
+    long long iterations = 0;
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    double elapsed = 0;
+    do {
+        for (int i = 0; i < 256; i++) convert_patch(image, length, "bench_a.syx", splitData1, splitData2, nBanks, "bench_b.syx");
+        iterations += 256;
+        elapsed = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    } while (elapsed < 0.25);
+    double rate = 2.0 * VOICES_PER_BANK * iterations / elapsed / 1e6;
+    ostringstream detail;
+    detail << fixed << setprecision(2) << " (" << rate << " Mvoices/s, minimum " << minRate << ")";
+    report("convert_patch throughput", rate >= minRate, detail.str());
+
+    cout << (nFailed ? "Self-test FAILED" : "Self-test passed") << endl;
+    return nFailed ? 1 : 0;
+}
+
+bool has_extension(const string& filename, const char* ext) {
+    // Case-insensitive check of the end of a filename
+    size_t len = strlen(ext);
+    if (filename.size() < len) return false;
+    for (size_t i = 0; i < len; i++) {
+        if (tolower(static_cast<unsigned char>(filename[filename.size() - len + i])) != tolower(static_cast<unsigned char>(ext[i]))) return false;
+    }
+    return true;
+}
+
+bool is_patch_file(const string& filename) {
+    // What batch and watch mode pick up from a directory
+    return has_extension(filename, ".pat") || has_extension(filename, ".002");
+}
+
+bool is_bank_file(const string& filename) {
+    // What verify mode picks up from a directory
+    return has_extension(filename, ".syx");
+}
+
+bool resolve_patfile(string& patfile_name) {
+    // Tries patfile as given, then with ".pat" and ".002" when it has no extension, ignoring case
+    return file_resolver.resolve(patfile_name);
+}
+
+WriteResult write_to_file(const SysexBank& splitData1, const char* output_bank1, const SysexBank* splitData2, const char* output_bank2, bool toStdout) {
+    // In pipe mode the bank messages go to stdout back to back
+    if (toStdout) return write_stdout(splitData1, splitData2) ? WriteResult::Written : WriteResult::Failed;
+
+    // With a MIDI port open the banks go straight to the synth instead, bank A first
+    if (midi_out.is_open()) {
+        bool sent = midi_out.send_bank(splitData1, options.pacing) && (!splitData2 || midi_out.send_bank(*splitData2, options.pacing));
+        return sent ? WriteResult::Written : WriteResult::Failed;
+    }
+
+    // Both sysex images are complete, so each bank file takes a single open and a single write.
+    // The pair counts as skipped only when neither bank file was replaced.
+    WriteResult result = write_image(splitData1.data(), splitData1.size(), output_bank1);
+    if (result == WriteResult::Failed || !splitData2) return result;
+    WriteResult result2 = write_image((*splitData2).data(), (*splitData2).size(), output_bank2);
+    if (result2 == WriteResult::Failed) return result2;
+    return (result == WriteResult::Skipped && result2 == WriteResult::Skipped) ? WriteResult::Skipped : WriteResult::Written;
+}
+
+WriteResult write_image(const char* image, size_t length, const char* filename) {
+    error_code ec;
+    if (options.overwrite == OverwritePolicy::SkipExisting && filesystem::exists(filename, ec)) return WriteResult::Skipped;
+    if (options.overwrite == OverwritePolicy::IfChanged && same_contents(image, length, filename)) return WriteResult::Skipped;
+
+    // The image goes to a temporary file next to the target, which is then renamed over it. An interrupted
+    // or failed write leaves the old file intact, and nothing ever sees a half-written bank. The name is
+    // unique per process and per call, so workers writing to the same directory don't collide.
+    static const unsigned token = random_device{}();
+    static atomic<unsigned> nTemp(0);
+    string temp_name = string(filename) + "." + to_string(token) + "-" + to_string(nTemp++) + ".tmp";
+
+    // Unbuffered, so the whole image goes out in one write straight from memory instead of being
+    // copied into the stream's buffer first
+    ofstream out_file;
+    out_file.rdbuf()->pubsetbuf(nullptr, 0);
+    out_file.open(temp_name, ios::binary | ios::trunc);
+    out_file.write(image, length);
+    out_file.close();
+    stats.add_io(4, 0, length);
+    if (out_file.fail()) {
+        filesystem::remove(temp_name, ec);
+        return WriteResult::Failed;
+    }
+
+    filesystem::rename(temp_name, filename, ec);
+    if (ec) {
+        filesystem::remove(temp_name, ec);
+        return WriteResult::Failed;
+    }
+    return WriteResult::Written;
+}
+
+WriteResult write_single_file(const SysexBank& splitData1, const SysexBank* splitData2, const char* filename, bool toStdout) {
+    // Every bank in one file: a .mid wraps them as sysex events, anything else holds the bank messages back
+    // to back, which is what a sysex librarian expects of a multi-bank .syx
+    char image[MAX_MIDI_FILE_SIZE];
+    size_t length = 0;
+    if (has_extension(filename, ".mid")) {
+        length = build_midi_file(splitData1, splitData2, MIDI_BANK_GAP_MS, image);
+    }
+    else {
+        memcpy(image, splitData1.data(), splitData1.size());
+        length = splitData1.size();
+        if (splitData2) {
+            memcpy(image + length, (*splitData2).data(), (*splitData2).size());
+            length += (*splitData2).size();
+        }
+    }
+
+    if (toStdout) return write_stdout(image, length) ? WriteResult::Written : WriteResult::Failed;
+    return write_image(image, length, filename);
+}
+
+bool same_contents(const char* image, size_t length, const char* filename) {
+    // A size mismatch settles it without opening the file; otherwise one read of the old contents
+    error_code ec;
+    uintmax_t size = filesystem::file_size(filename, ec);
+    if (ec || size != length) return false;
+
+    vector<char> existing(length);
+    ifstream in_file(filename, ios::binary);
+    in_file.read(existing.data(), length);
+    stats.add_io(3, static_cast<uint64_t>(in_file.gcount()), 0);
+    return static_cast<size_t>(in_file.gcount()) == length && memcmp(existing.data(), image, length) == 0;
+}
+
+bool write_stdout(const SysexBank& splitData1, const SysexBank* splitData2) {
+    set_binary_mode(stdout);
+    fwrite(splitData1.data(), 1, splitData1.size(), stdout);
+    if (splitData2) fwrite((*splitData2).data(), 1, (*splitData2).size(), stdout);
+    stats.add_io(splitData2 ? 3 : 2, 0, splitData1.size() + (splitData2 ? (*splitData2).size() : 0));
+    return fflush(stdout) == 0 && !ferror(stdout);
+}
+
+bool write_stdout(const char* image, size_t length) {
+    set_binary_mode(stdout);
+    fwrite(image, 1, length, stdout);
+    stats.add_io(2, 0, length);
+    return fflush(stdout) == 0 && !ferror(stdout);
+}
+
+void set_binary_mode(FILE* stream) {
+    // stdin and stdout are opened in text mode on Windows, which would mangle 0x0A and 0x1A bytes
+#ifdef _WIN32
+    _setmode(_fileno(stream), _O_BINARY);
+#else
+    (void)stream;
+#endif
+}
+
+bool overwrite_check(string output_filename) {
+    // Only asks; the file is left untouched until write_image replaces it with the finished bank. The other
+    // policies are settled in write_image without asking.
+    if (options.overwrite != OverwritePolicy::Ask) return true;
+    error_code ec;
+    if (filesystem::exists(output_filename, ec)) {
+        // With --quiet there's no one to ask, so the file stays
+        if (options.quiet) return false;
+        lock_guard<mutex> lock(console_mutex);
         cout << "\"" << output_filename << "\" already exists. Do you want to overwrite it? (Y/N): ";
         string answer;
         cin >> answer;
         if (answer == "Y" || answer == "y") {
-            ofstream file(output_filename, ios::trunc);
             cout << "OVERWRITTEN!" << endl << endl;
-            file.close();
         }
         else {
             cout << "Aborting..." << endl;
-            exit(EXIT_FAILURE);
+            return false;
         }
     }
+    return true;
 }
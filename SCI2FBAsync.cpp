@@ -0,0 +1,333 @@
+/************************************************************************
+*   SCI2FB asynchronous reads                                           *
+*                                                                       *
+*   See SCI2FBAsync.h                                                   *
+************************************************************************/
+
+#include "SCI2FBAsync.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#endif
+
+using namespace std;
+
+static long long read_blocking(const string& filename, char* buffer, size_t size) {
+    ifstream file(filename, ios::binary);
+    if (!file.good()) return -1;
+    file.read(buffer, size);
+    return file.gcount();
+}
+
+// Out of line, where the platform's I/O structures the members hold are complete types
+AsyncReader::AsyncReader() = default;
+
+void AsyncReader::open(const vector<string>& fileList, size_t bufferSize, unsigned depth, bool async) {
+    files = &fileList;
+    maxSize = bufferSize;
+    if (depth == 0) depth = 1;
+    buffers.resize(depth * maxSize);
+    slotFile.resize(depth);
+    for (unsigned slot = depth; slot-- > 0;) freeSlots.push_back(slot);
+    if (!async) return;
+
+#ifdef _WIN32
+    port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, nullptr, 0, 0);
+    handles.resize(depth, nullptr);
+    overlapped.resize(depth);
+#else
+    fds.resize(depth, -1);
+    iovecs.resize(depth);
+    setup_ring(depth);
+#endif
+}
+
+bool AsyncReader::next(AsyncRead& read) {
+    unique_lock<mutex> lock(reader_mutex);
+
+    // Blocking reads happen outside the lock, so threads calling in still read in parallel
+    if (!is_async()) {
+        slot_released.wait(lock, [&]() { return nextFile >= files->size() || !freeSlots.empty(); });
+        if (nextFile >= files->size()) return false;
+        unsigned slot = freeSlots.back();
+        freeSlots.pop_back();
+        size_t index = nextFile++;
+        lock.unlock();
+        read = { index, buffer(slot), read_blocking((*files)[index], buffer(slot), maxSize), slot };
+        return true;
+    }
+
+    for (;;) {
+        start_reads();
+        if (!completed.empty()) {
+            read = completed.front();
+            completed.pop_front();
+            return true;
+        }
+        if (inFlight == 0) {
+            if (nextFile >= files->size()) return false;
+            // Every buffer is out with a caller, so nothing can be read until one comes back
+            slot_released.wait(lock);
+            continue;
+        }
+        // One thread at a time waits on the reads in flight, with the lock released so release() isn't held up
+        // meanwhile. The others sleep until it has collected what finished.
+        if (waiting) {
+            slot_released.wait(lock);
+            continue;
+        }
+        if (!wait_completions(lock)) return false;
+    }
+}
+
+void AsyncReader::release(const AsyncRead& read) {
+    lock_guard<mutex> lock(reader_mutex);
+    freeSlots.push_back(read.slot);
+    slot_released.notify_all();
+}
+
+void AsyncReader::start_reads() {
+    // Keep every free buffer busy with the next file
+    while (!freeSlots.empty() && nextFile < files->size()) {
+        unsigned slot = freeSlots.back();
+        freeSlots.pop_back();
+        slotFile[slot] = nextFile++;
+        if (!submit(slot)) finish(slot, -1);
+    }
+    submit_pending();
+}
+
+void AsyncReader::finish(unsigned slot, long long length) {
+    completed.push_back({ slotFile[slot], buffer(slot), length, slot });
+}
+
+#ifdef _WIN32
+
+AsyncReader::~AsyncReader() {
+    // Anything still in flight has to finish before its buffer goes away
+    for (size_t slot = 0; slot < handles.size(); slot++) {
+        if (!handles[slot]) continue;
+        CancelIo(handles[slot]);
+        DWORD length = 0;
+        GetOverlappedResult(handles[slot], &overlapped[slot], &length, TRUE);
+        CloseHandle(handles[slot]);
+    }
+    if (port) CloseHandle(port);
+}
+
+bool AsyncReader::is_async() const {
+    return port != nullptr;
+}
+
+const char* AsyncReader::backend() const {
+    return is_async() ? "overlapped" : "blocking";
+}
+
+bool AsyncReader::submit(unsigned slot) {
+    HANDLE handle = CreateFileW(filesystem::path((*files)[slotFile[slot]]).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ,
+                                nullptr, OPEN_EXISTING, FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) return false;
+    // The completion key tells wait_completions which buffer finished
+    if (!CreateIoCompletionPort(handle, port, slot, 0)) {
+        CloseHandle(handle);
+        return false;
+    }
+
+    overlapped[slot] = {};
+    if (!ReadFile(handle, buffer(slot), static_cast<DWORD>(maxSize), nullptr, &overlapped[slot]) && GetLastError() != ERROR_IO_PENDING) {
+        // A read that fails straight away (an empty file reports end of file) never reaches the port
+        DWORD error = GetLastError();
+        CloseHandle(handle);
+        finish(slot, (error == ERROR_HANDLE_EOF) ? 0 : -1);
+        return true;
+    }
+    handles[slot] = handle;
+    inFlight++;
+    return true;
+}
+
+void AsyncReader::submit_pending() {
+    // ReadFile has already started each read
+}
+
+bool AsyncReader::wait_completions(unique_lock<mutex>& lock) {
+    DWORD length = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED* ov = nullptr;
+    waiting = true;
+    lock.unlock();
+    BOOL ok = GetQueuedCompletionStatus(port, &length, &key, &ov, INFINITE);
+    DWORD error = ok ? ERROR_SUCCESS : GetLastError();
+    lock.lock();
+    waiting = false;
+    slot_released.notify_all();
+    if (!ov) return false;
+
+    unsigned slot = static_cast<unsigned>(key);
+    CloseHandle(handles[slot]);
+    handles[slot] = nullptr;
+    inFlight--;
+    finish(slot, ok ? static_cast<long long>(length) : ((error == ERROR_HANDLE_EOF) ? 0 : -1));
+    return true;
+}
+
+#else
+
+// glibc has no wrappers for the io_uring system calls, and liburing would be one more dependency for what
+// is a couple of ring buffers shared with the kernel
+static int io_uring_setup(unsigned entries, io_uring_params* params) {
+    return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+}
+
+static int io_uring_enter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags) {
+    return static_cast<int>(syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0));
+}
+
+AsyncReader::~AsyncReader() {
+    // Reads still in flight (only after a failed wait) must land before their buffers go away
+    unique_lock<mutex> lock(reader_mutex);
+    while (ring >= 0 && inFlight > 0 && wait_completions(lock)) {}
+    lock.unlock();
+    if (sqes) munmap(sqes, sqesSize);
+    if (cqRing && cqRing != sqRing) munmap(cqRing, cqRingSize);
+    if (sqRing) munmap(sqRing, sqRingSize);
+    if (ring >= 0) close(ring);
+    for (int fd : fds) {
+        if (fd >= 0) close(fd);
+    }
+}
+
+bool AsyncReader::setup_ring(unsigned depth) {
+    // Fails on kernels before 5.1 and where io_uring is turned off (as it is in many containers), leaving
+    // the blocking reads
+    io_uring_params params = {};
+    int fd = io_uring_setup(depth, &params);
+    if (fd < 0) return false;
+
+    sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    bool singleMap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (singleMap) sqRingSize = cqRingSize = max(sqRingSize, cqRingSize);
+    sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+
+    void* sq = mmap(nullptr, sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    void* cq = singleMap ? sq : mmap(nullptr, cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void* entries = mmap(nullptr, sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || entries == MAP_FAILED) {
+        if (entries != MAP_FAILED) munmap(entries, sqesSize);
+        if (cq != MAP_FAILED && cq != sq) munmap(cq, cqRingSize);
+        if (sq != MAP_FAILED) munmap(sq, sqRingSize);
+        close(fd);
+        return false;
+    }
+
+    char* sqBase = static_cast<char*>(sq);
+    char* cqBase = static_cast<char*>(cq);
+    sqRing = sq;
+    cqRing = cq;
+    sqes = entries;
+    sqHead = reinterpret_cast<unsigned*>(sqBase + params.sq_off.head);
+    sqTail = reinterpret_cast<unsigned*>(sqBase + params.sq_off.tail);
+    sqMask = reinterpret_cast<unsigned*>(sqBase + params.sq_off.ring_mask);
+    sqArray = reinterpret_cast<unsigned*>(sqBase + params.sq_off.array);
+    cqHead = reinterpret_cast<unsigned*>(cqBase + params.cq_off.head);
+    cqTail = reinterpret_cast<unsigned*>(cqBase + params.cq_off.tail);
+    cqMask = reinterpret_cast<unsigned*>(cqBase + params.cq_off.ring_mask);
+    cqes = cqBase + params.cq_off.cqes;
+    ring = fd;
+    return true;
+}
+
+bool AsyncReader::is_async() const {
+    return ring >= 0;
+}
+
+const char* AsyncReader::backend() const {
+    return is_async() ? "io_uring" : "blocking";
+}
+
+bool AsyncReader::submit(unsigned slot) {
+    // The open stays synchronous; it's the reads that stall on slow storage
+    int fd = ::open((*files)[slotFile[slot]].c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return false;
+    fds[slot] = fd;
+    iovecs[slot].iov_base = buffer(slot);
+    iovecs[slot].iov_len = maxSize;
+
+    // Only ever called with the reader's lock held, so this is the ring's only producer. READV rather than
+    // READ, which needs 5.6. A regular file read comes back whole unless it reaches end of file, so one read
+    // per file is enough.
+    unsigned tail = *sqTail;
+    unsigned index = tail & *sqMask;
+    io_uring_sqe* sqe = static_cast<io_uring_sqe*>(sqes) + index;
+    *sqe = {};
+    sqe->opcode = IORING_OP_READV;
+    sqe->fd = fd;
+    sqe->addr = reinterpret_cast<uintptr_t>(&iovecs[slot]);
+    sqe->len = 1;
+    sqe->off = 0;
+    sqe->user_data = slot;
+    sqArray[index] = index;
+    __atomic_store_n(sqTail, tail + 1, __ATOMIC_RELEASE);
+    pending++;
+    inFlight++;
+    return true;
+}
+
+void AsyncReader::submit_pending() {
+    // Everything queued by start_reads goes to the kernel in one system call
+    if (pending == 0) return;
+    int submitted = io_uring_enter(ring, pending, 0, 0);
+    if (submitted > 0) pending -= submitted;
+}
+
+bool AsyncReader::wait_completions(unique_lock<mutex>& lock) {
+    // Whatever is queued goes to the kernel first, under the lock, since submitting is the producer's job.
+    // The wait itself only reads the completion queue, which nobody else touches while "waiting" is set, so
+    // it happens with the lock released. Submissions the kernel turned down are retried with the wait.
+    submit_pending();
+    int result = 0;
+    if (pending > 0) {
+        result = io_uring_enter(ring, pending, 1, IORING_ENTER_GETEVENTS);
+        if (result > 0) pending -= result;
+    }
+    else {
+        waiting = true;
+        lock.unlock();
+        result = io_uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS);
+        int waitErrno = errno;
+        lock.lock();
+        waiting = false;
+        slot_released.notify_all();
+        errno = waitErrno;
+    }
+    if (result < 0) return errno == EINTR;
+
+    unsigned head = *cqHead;
+    unsigned tail = __atomic_load_n(cqTail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const io_uring_cqe* cqe = static_cast<const io_uring_cqe*>(cqes) + (head & *cqMask);
+        unsigned slot = static_cast<unsigned>(cqe->user_data);
+        close(fds[slot]);
+        fds[slot] = -1;
+        inFlight--;
+        finish(slot, (cqe->res < 0) ? -1 : cqe->res);
+    }
+    __atomic_store_n(cqHead, head, __ATOMIC_RELEASE);
+    return true;
+}
+
+#endif
@@ -0,0 +1,110 @@
+/************************************************************************
+*   SCI2FB asynchronous reads                                           *
+*                                                                       *
+*   Reads a list of small files with many reads in flight at once, so   *
+*   batch mode isn't left waiting on one file at a time. Uses io_uring  *
+*   on Linux and overlapped I/O on Windows, and plain blocking reads    *
+*   wherever neither is available.                                      *
+************************************************************************/
+
+#ifndef SCI2FB_ASYNC_H
+#define SCI2FB_ASYNC_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+struct _OVERLAPPED;
+#else
+struct iovec;
+#endif
+
+// One finished read, handed out by AsyncReader::next
+struct AsyncRead {
+    size_t index;               // Position of the file in the list given to open()
+    const char* data;           // The bytes read, valid until the read is released
+    long long length;           // Bytes read, or -1 when the file couldn't be opened or read
+    unsigned slot;              // Buffer the data lives in
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  Every file gets a single read of up to maxSize bytes into one of "depth" buffers.   //
+//  Up to "depth" reads are in flight at once; a buffer only gets its next file once    //
+//  whoever took the finished read from next() has released it, so the buffers are      //
+//  allocated once and memory use stays fixed however many files there are. Reads are  //
+//  handed out in the order they complete, which isn't necessarily the list order.      //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class AsyncReader {
+public:
+    AsyncReader();
+    AsyncReader(const AsyncReader&) = delete;
+    AsyncReader& operator=(const AsyncReader&) = delete;
+    ~AsyncReader();
+
+    // Sets up reads of "files", which must outlive the reader. Without "async", or where the platform can't
+    // do asynchronous I/O, each file is instead read by whichever thread asks for it, into a free buffer.
+    void open(const std::vector<std::string>& files, size_t maxSize, unsigned depth, bool async);
+
+    // Blocks until another file has been read. Returns false once every file has been handed out. Safe to
+    // call from several threads.
+    bool next(AsyncRead& read);
+    void release(const AsyncRead& read);
+
+    // "io_uring", "overlapped" or "blocking"
+    const char* backend() const;
+
+private:
+    const std::vector<std::string>* files = nullptr;
+    size_t maxSize = 0;
+    size_t nextFile = 0;
+    unsigned inFlight = 0;
+    std::vector<char> buffers;
+    std::vector<size_t> slotFile;           // File each buffer is being (or was last) filled with
+    std::vector<unsigned> freeSlots;
+    std::deque<AsyncRead> completed;
+    std::mutex reader_mutex;
+    std::condition_variable slot_released;
+    bool waiting = false;                   // A thread is waiting on the reads in flight with the lock released
+
+    char* buffer(unsigned slot) { return buffers.data() + slot * maxSize; }
+    bool is_async() const;
+    void start_reads();
+    bool submit(unsigned slot);
+    void submit_pending();
+    bool wait_completions(std::unique_lock<std::mutex>& lock);
+    void finish(unsigned slot, long long length);
+
+#ifdef _WIN32
+    void* port = nullptr;
+    std::vector<void*> handles;
+    std::vector<_OVERLAPPED> overlapped;
+#else
+    int ring = -1;
+    void* sqRing = nullptr;
+    void* cqRing = nullptr;
+    void* sqes = nullptr;
+    size_t sqRingSize = 0;
+    size_t cqRingSize = 0;
+    size_t sqesSize = 0;
+    unsigned* sqHead = nullptr;
+    unsigned* sqTail = nullptr;
+    unsigned* sqMask = nullptr;
+    unsigned* sqArray = nullptr;
+    unsigned* cqHead = nullptr;
+    unsigned* cqTail = nullptr;
+    unsigned* cqMask = nullptr;
+    void* cqes = nullptr;
+    unsigned pending = 0;                   // Queued submissions the kernel hasn't been told about yet
+    std::vector<int> fds;
+    std::vector<iovec> iovecs;
+
+    bool setup_ring(unsigned depth);
+#endif
+};
+
+#endif
@@ -0,0 +1,81 @@
+/************************************************************************
+*   SCI2FB conversion cache                                             *
+*                                                                       *
+*   See SCI2FBCache.h                                                   *
+************************************************************************/
+
+#include "SCI2FBCache.h"
+
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <random>
+
+using namespace std;
+
+static uint64_t hash_bytes(const char* data, size_t length, uint64_t hash) {
+    // 64-bit FNV-1a, continuing from "hash"
+    for (size_t i = 0; i < length; i++) {
+        hash ^= static_cast<unsigned char>(data[i]);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+bool ConversionCache::open(const string& cache_dir, string& error) {
+    error_code ec;
+    filesystem::create_directories(cache_dir, ec);
+    if (!filesystem::is_directory(cache_dir, ec)) {
+        error = "could not open conversion cache " + cache_dir;
+        return false;
+    }
+    dir = cache_dir;
+    return true;
+}
+
+CacheKey ConversionCache::key(const char* image, size_t length, const char* label, const char* labelB) {
+    // The labels are hashed with their terminating NULs, so moving characters between them changes the key
+    uint64_t hash = hash_bytes(image, length, 0xCBF29CE484222325ULL);
+    hash = hash_bytes(label, strlen(label) + 1, hash);
+    if (labelB) hash = hash_bytes(labelB, strlen(labelB) + 1, hash);
+    return hash;
+}
+
+string ConversionCache::entry_path(CacheKey key) const {
+    char name[24];
+    snprintf(name, sizeof(name), "%016llx.syx", static_cast<unsigned long long>(key));
+    return (filesystem::path(dir) / name).string();
+}
+
+bool ConversionCache::load(CacheKey key, SysexBank& outA, SysexBank* outB) {
+    // One read of the whole entry; a short or overlong file is treated as a miss and later overwritten
+    ifstream entry(entry_path(key), ios::binary);
+    char extra;
+    bool hit = entry.good() && entry.read(outA.data(), outA.size()) &&
+               (!outB || entry.read((*outB).data(), (*outB).size())) && !entry.read(&extra, 1);
+    hit = hit && outA[0] == (char)0xF0 && outA[BANK_SYSEX_SIZE - 1] == (char)0xF7;
+    hit ? nHits++ : nMisses++;
+    return hit;
+}
+
+bool ConversionCache::store(CacheKey key, const SysexBank& outA, const SysexBank* outB) {
+    static const unsigned token = random_device{}();
+    string path = entry_path(key);
+    string temp_name = path + "." + to_string(token) + "-" + to_string(nTemp++) + ".tmp";
+
+    ofstream entry(temp_name, ios::binary | ios::trunc);
+    entry.write(outA.data(), outA.size());
+    if (outB) entry.write((*outB).data(), (*outB).size());
+    entry.close();
+
+    error_code ec;
+    if (entry.fail()) {
+        filesystem::remove(temp_name, ec);
+        return false;
+    }
+    filesystem::rename(temp_name, path, ec);
+    if (!ec) return true;
+    filesystem::remove(temp_name, ec);
+    return false;
+}
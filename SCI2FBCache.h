@@ -0,0 +1,52 @@
+/************************************************************************
+*   SCI2FB conversion cache                                             *
+*                                                                       *
+*   On-disk cache of generated sysex banks, keyed by a hash of the      *
+*   patch resource bytes and the bank labels, so converting an input    *
+*   seen before is a lookup and a copy.                                 *
+************************************************************************/
+
+#ifndef SCI2FB_CACHE_H
+#define SCI2FB_CACHE_H
+
+#include "SCI2FBCore.h"
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  A cache is a directory of files named after the 16 hex digit key, each holding the  //
+//  complete sysex bank(s) for that input: 6363 bytes for one bank, 12726 for two.      //
+//  Entries are written to a temporary file and renamed into place, so concurrent runs  //
+//  can share a cache and a half-written entry is never read.                           //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+typedef uint64_t CacheKey;
+
+class ConversionCache {
+public:
+    // Opens (creating if needed) the cache in directory "dir". Returns false with "error" set on failure.
+    bool open(const std::string& dir, std::string& error);
+    bool is_open() const { return !dir.empty(); }
+
+    // The key for a patch resource image converted under the given bank labels (labelB only for two banks)
+    static CacheKey key(const char* image, size_t length, const char* label, const char* labelB);
+
+    // Fills the bank(s) from the cache. Returns false when the entry is missing or isn't the right size.
+    bool load(CacheKey key, SysexBank& outA, SysexBank* outB);
+    bool store(CacheKey key, const SysexBank& outA, const SysexBank* outB);
+
+    size_t hits() const { return nHits; }
+    size_t misses() const { return nMisses; }
+
+private:
+    std::string dir;
+    std::atomic<size_t> nHits{0};
+    std::atomic<size_t> nMisses{0};
+    std::atomic<unsigned> nTemp{0};
+
+    std::string entry_path(CacheKey key) const;
+};
+
+#endif
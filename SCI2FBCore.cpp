@@ -0,0 +1,621 @@
+/************************************************************************
+*   SCI2FB conversion core                                              *
+*                                                                       *
+*   Validation, nibblizing and bank header generation. See SCI2FBCore.h *
+************************************************************************/
+
+#include "SCI2FBCore.h"
+
+#include <cstring>
+#include <cctype>
+
+// SIMD nibblize kernels are used where the target guarantees them. Define SCI2FB_NO_SIMD to force the
+// table-driven scalar path.
+#if !defined(SCI2FB_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCI2FB_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SCI2FB_NEON
+#endif
+#endif
+
+using namespace std;
+
+// Every byte value split into its (low nibble, high nibble) pair in sysex order, plus the sum of that pair
+// for the packet checksums. Built at compile time.
+struct NibbleTable {
+    unsigned char pair[256][2];
+    unsigned char sum[256];
+};
+
+constexpr NibbleTable make_nibble_table() {
+    NibbleTable table = {};
+    for (int b = 0; b < 256; b++) {
+        table.pair[b][0] = b & 0x0F;
+        table.pair[b][1] = (b >> 4) & 0x0F;
+        table.sum[b] = table.pair[b][0] + table.pair[b][1];
+    }
+    return table;
+}
+
+constexpr NibbleTable nibble_table = make_nibble_table();
+
+const char* patch_error_message(PatchError error) {
+    switch (error) {
+    case PatchError::None:
+        return "no error";
+    case PatchError::InvalidHeader:
+        return "invalid header! Input file is corrupt or not a valid SCI patch resource";
+    case PatchError::InvalidSize:
+        return "not the expected size (3074 or 6148 bytes + title string length). Not a valid FB-01 SCI0 Patch file.";
+    case PatchError::MissingSeparator:
+        return "bank separator bytes missing! Input file is not a valid FB-01 SCI patch resource.";
+    case PatchError::InvalidSysex:
+        return "not a valid FB-01 sysex bank dump";
+    case PatchError::BadChecksum:
+        return "checksum mismatch! Sysex bank dump is corrupt";
+    }
+    return "unknown error";
+}
+
+PatchError check_patch(const char* image, size_t length, int& nBanks) {
+    PatchError error = check_patch_header(image, length, nBanks);
+    if (error != PatchError::None || nBanks == 1) return error;
+    return check_separator(image + separator_offset(static_cast<unsigned char>(image[1])));
+}
+
+PatchError check_patch_header(const char* header, size_t length, int& nBanks) {
+    // Check if the SCI patch resource identifier header exists
+    if (length < 2 || header[0] != (char)0x89) return PatchError::InvalidHeader;
+
+    // Check for title string length in second byte of header to use as offset for future file handling
+    size_t titleOffset = static_cast<unsigned char>(header[1]);
+
+    // Check size of file to ensure it's valid and determine if it holds one or two banks
+    if (length == 6148 + titleOffset) {
+        nBanks = 2;
+    }
+    else if (length == 3074 + titleOffset) {
+        nBanks = 1;
+    }
+    else {
+        return PatchError::InvalidSize;
+    }
+    return PatchError::None;
+}
+
+PatchError check_separator(const char* separator) {
+    // Ensure the ABCDh bytes exist at address 0xC02 between the two banks. Both bytes have to match.
+    if (separator[0] != (char)0xAB || separator[1] != (char)0xCD) return PatchError::MissingSeparator;
+    return PatchError::None;
+}
+
+size_t separator_offset(size_t titleOffset) {
+    // (offset by the title string length from the file header)
+    return 0xC02 + titleOffset;
+}
+
+const char* patch_format_name(PatchFormat format) {
+    switch (format) {
+    case PatchFormat::Sci0:
+        return "SCI0 patch resource";
+    case PatchFormat::Padded:
+        return "padded patch resource";
+    case PatchFormat::Raw:
+        return "raw voice dump";
+    case PatchFormat::Volume:
+        return "patch resource in a resource volume";
+    }
+    return "unknown format";
+}
+
+static bool detect_sci0(const char* header, size_t length, PatchLayout& layout) {
+    if (check_patch_header(header, length, layout.nBanks) != PatchError::None) return false;
+    size_t titleOffset = static_cast<unsigned char>(header[1]);
+    layout.voiceOffset[0] = 0x02 + titleOffset;
+    layout.voiceOffset[1] = separator_offset(titleOffset) + 2;
+    layout.separatorOffset = (layout.nBanks == 2) ? separator_offset(titleOffset) : 0;
+    return true;
+}
+
+static bool detect_padded(const char* header, size_t length, PatchLayout& layout) {
+    // Copies made by block-based transfer and archiving tools are filled out to the next 128-byte boundary.
+    // Only a complete one or two bank layout followed by less than a block counts; anything else between or
+    // past the two sizes is a damaged patch and is still rejected. A two bank patch cut off soon after bank A
+    // doesn't pass as a padded one bank patch either: its ABCDh separator sits where the padding would start,
+    // and check_padding turns that down.
+    if (length < 2 || header[0] != (char)0x89) return false;
+    size_t titleOffset = static_cast<unsigned char>(header[1]);
+    size_t end1 = separator_offset(titleOffset);
+    size_t end2 = separator_offset(titleOffset) + 2 + VOICES_PER_BANK * VOICE_SIZE;
+    auto padded_to = [&](size_t end) { return length > end && length % PADDING_BLOCK_SIZE == 0 && length - end < PADDING_BLOCK_SIZE; };
+    if (!padded_to(end1) && !padded_to(end2)) return false;
+    layout.nBanks = padded_to(end2) ? 2 : 1;
+    layout.voiceOffset[0] = 0x02 + titleOffset;
+    layout.voiceOffset[1] = separator_offset(titleOffset) + 2;
+    layout.separatorOffset = (layout.nBanks == 2) ? separator_offset(titleOffset) : 0;
+    layout.paddingOffset = (layout.nBanks == 2) ? end2 : end1;
+    return true;
+}
+
+static bool detect_raw(const char*, size_t length, PatchLayout& layout) {
+    // The voice data alone, as a sysex librarian or an emulator's memory dump saves it
+    size_t bankSize = VOICES_PER_BANK * VOICE_SIZE;
+    if (length != bankSize && length != 2 * bankSize && length != 2 * bankSize + 2) return false;
+    layout.nBanks = (length == bankSize) ? 1 : 2;
+    layout.voiceOffset[0] = 0;
+    layout.voiceOffset[1] = (length == 2 * bankSize + 2) ? bankSize + 2 : bankSize;
+    layout.separatorOffset = (length == 2 * bankSize + 2) ? bankSize : 0;
+    return true;
+}
+
+// Tried in order, so the exact SCI0 layout wins over the looser ones
+struct PatchFormatDetector {
+    PatchFormat format;
+    bool (*detect)(const char* header, size_t length, PatchLayout& layout);
+};
+
+static const PatchFormatDetector patch_formats[] = {
+    { PatchFormat::Sci0, detect_sci0 },
+    { PatchFormat::Padded, detect_padded },
+    { PatchFormat::Raw, detect_raw },
+};
+
+PatchError detect_patch_format(const char* header, size_t length, PatchLayout& layout, bool allowRaw) {
+    for (const PatchFormatDetector& detector : patch_formats) {
+        if (detector.format == PatchFormat::Raw && !allowRaw) continue;
+        if (detector.detect(header, length, layout)) {
+            layout.format = detector.format;
+            return PatchError::None;
+        }
+    }
+    int nBanks = 0;
+    return check_patch_header(header, length, nBanks);
+}
+
+PatchError check_padding(const char* padding, size_t length) {
+    // Filled with zeros, or with the DOS end of file character
+    for (size_t i = 0; i < length; i++) {
+        if (padding[i] != '\0' && padding[i] != '\x1A') return PatchError::InvalidSize;
+    }
+    return PatchError::None;
+}
+
+PatchError find_patch_layout(const char* image, size_t length, PatchLayout& layout, bool allowRaw) {
+    PatchError error = detect_patch_format(image, length, layout, allowRaw);
+    if (error == PatchError::None && layout.separatorOffset != 0) error = check_separator(image + layout.separatorOffset);
+    if (error == PatchError::None && layout.paddingOffset != 0) error = check_padding(image + layout.paddingOffset, length - layout.paddingOffset);
+    return error;
+}
+
+PatchError volume_patch_layout(const char* image, size_t length, PatchLayout& layout) {
+    size_t bankSize = VOICES_PER_BANK * VOICE_SIZE;
+    if (length != bankSize && length != 2 * bankSize + 2) return PatchError::InvalidSize;
+    layout.format = PatchFormat::Volume;
+    layout.nBanks = (length == bankSize) ? 1 : 2;
+    layout.voiceOffset[0] = 0;
+    layout.voiceOffset[1] = bankSize + 2;
+    layout.separatorOffset = (layout.nBanks == 2) ? bankSize : 0;
+    layout.paddingOffset = 0;
+    return (layout.nBanks == 2) ? check_separator(image + bankSize) : PatchError::None;
+}
+
+void read_patch(const char* image, const PatchLayout& layout, RawBank& data1, RawBank* data2) {
+    memcpy(data1.data(), image + layout.voiceOffset[0], data1.size());
+    if (data2) memcpy((*data2).data(), image + layout.voiceOffset[1], (*data2).size());
+}
+
+PatchError convert_patch(const char* image, size_t length, const char* label, SysexBank& outA, SysexBank& outB,
+                         int& nBanks, const char* labelB, bool allowRaw) {
+    PatchLayout layout;
+    PatchError error = find_patch_layout(image, length, layout, allowRaw);
+    if (error != PatchError::None) return error;
+
+    nBanks = layout.nBanks;
+    convert_patch(image, layout, label, outA, outB, labelB);
+    return PatchError::None;
+}
+
+void convert_patch(const char* image, const PatchLayout& layout, const char* label, SysexBank& outA, SysexBank& outB,
+                   const char* labelB) {
+    bool twoBanks = (layout.nBanks == 2);
+
+    // Pull the instrument voice data out of the patch image
+    RawBank data1;
+    RawBank data2;
+    read_patch(image, layout, data1, twoBanks ? &data2 : nullptr);
+
+    // Split the bytes of each instrument voice packet in order of: low nibble = high byte, high nibble = low byte,
+    // then put the bank header in front of the packets
+    nibblize_data(data1, outA);
+    build_bank_header(outA, 0, label, twoBanks);
+
+    if (twoBanks) {
+        nibblize_data(data2, outB);
+        build_bank_header(outB, 1, labelB ? labelB : label, twoBanks);
+    }
+}
+
+void nibblize_data(const RawBank& data, SysexBank& splitData) {
+    //////////////////////////////////////////////////////////////////////////////////////////////
+    //  Now we must nibblize the voice patch data by splitting each byte into pairs and         //
+    //  and storing them in order: low nibble = high byte, high nibble = low byte's low nibble. //
+    //  This will prepare the voice data properly for the sysex format and double the size of   //
+    //  each voice's byte data adding leading bytes (0x01 0x00) to signify the size of the      //
+    //  packet (128) and a checksum byte calculate with 2's complement of sum following it.     //
+    //  (131 bytes total per instrument voice)                                                  //
+    //////////////////////////////////////////////////////////////////////////////////////////////
+
+    // The voice packets follow the bank header in the sysex image
+    char* packets = splitData.data() + BANK_HEADER_SIZE;
+
+    for (int i = 0; i < VOICES_PER_BANK; i++) {
+        char* packet = packets + i * VOICE_PACKET_SIZE;
+
+        // set packet size of nibblized bytes preceding the packet:
+        //          0x01 0x00 = 128 (%0000000h, %0lllllll -> %00000000, %hlllllll)
+        packet[0] = 0x01;
+        packet[1] = 0x00;
+
+        // 64 bytes per packet, nibblized and checksummed in one pass
+        packet[130] = nibblize_packet(data.data() + i * VOICE_SIZE, VOICE_SIZE, packet + 2);
+    }
+}
+
+unsigned char nibblize_packet(const char* in, int nBytes, char* out) {
+    // Splits nBytes of "in" into 2 * nBytes of nibbles at "out" (low nibble first) and returns the packet's
+    // checksum: the 2's complement of the sum of every nibble written, masked to 7 bits. Packets are at most
+    // 64 bytes, so the SIMD accumulators below can never overflow.
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(in);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out);
+    unsigned int sum = 0;
+    int i = 0;
+
+#if defined(SCI2FB_SSE2)
+    // Mask the low and high nibbles of 16 bytes at a time, then interleave them with punpcklbw/punpckhbw.
+    // psadbw against zero sums the nibble pairs into each half of the accumulator.
+    const __m128i mask = _mm_set1_epi8(0x0F);
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    for (; i + 16 <= nBytes; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        __m128i low = _mm_and_si128(bytes, mask);
+        __m128i high = _mm_and_si128(_mm_srli_epi16(bytes, 4), mask);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2), _mm_unpacklo_epi8(low, high));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i * 2 + 16), _mm_unpackhi_epi8(low, high));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_add_epi8(low, high), zero));
+    }
+    sum += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+#elif defined(SCI2FB_NEON)
+    // vst2q interleaves the low and high nibble vectors on the way out to memory
+    const uint8x16_t mask = vdupq_n_u8(0x0F);
+    uint16x8_t acc = vdupq_n_u16(0);
+    for (; i + 16 <= nBytes; i += 16) {
+        uint8x16_t bytes = vld1q_u8(src + i);
+        uint8x16x2_t nibbles;
+        nibbles.val[0] = vandq_u8(bytes, mask);
+        nibbles.val[1] = vshrq_n_u8(bytes, 4);
+        vst2q_u8(dst + i * 2, nibbles);
+        acc = vpadalq_u8(acc, vaddq_u8(nibbles.val[0], nibbles.val[1]));
+    }
+    uint64x2_t acc64 = vpaddlq_u32(vpaddlq_u16(acc));
+    sum += static_cast<unsigned int>(vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+#endif
+
+    // Scalar fallback (and the tail of any packet that isn't a multiple of 16 bytes) using the lookup table
+    for (; i < nBytes; i++) {
+        dst[i * 2] = nibble_table.pair[src[i]][0];
+        dst[i * 2 + 1] = nibble_table.pair[src[i]][1];
+        sum += nibble_table.sum[src[i]];
+    }
+
+    // Drop all but the lowest 8 bits, flip the bits, add 1, then mask the lowest 7 bits for the correct checksum value
+    return ((~(sum & 0xFF)) + 1) & 0x7F;
+}
+
+// The parts of a bank header that never change for a given bank: the "send bank" code, the info packet
+// size, and the info packet nibblized with an empty name (plus the '1' or '2' bank number for two bank
+// patches). "sum" is the nibble sum of that fixed part, so the checksum only needs the label added to it.
+struct BankHeaderTemplate {
+    char bytes[BANK_HEADER_SIZE];
+    unsigned int sum;
+};
+
+template <int bank, bool twoBanks>
+constexpr BankHeaderTemplate make_bank_header_template() {
+    BankHeaderTemplate header = {};
+    const char code[9] = { '\xF0', '\x43', '\x75', '\x00', '\x00', '\x00', static_cast<char>(bank), '\x00', '\x40' };
+    for (int i = 0; i < 9; i++) header.bytes[i] = code[i];
+
+    // If two banks, the 8th character of the name is '1' or '2', signifying "part 1" or "part 2" in label
+    if (twoBanks) {
+        const unsigned char digit = '1' + bank;
+        header.bytes[9 + 7 * 2] = nibble_table.pair[digit][0];
+        header.bytes[9 + 7 * 2 + 1] = nibble_table.pair[digit][1];
+        header.sum = nibble_table.sum[digit];
+    }
+    return header;
+}
+
+template <int bank, bool twoBanks>
+constexpr BankHeaderTemplate bank_header_template = make_bank_header_template<bank, twoBanks>();
+
+template <int bank, bool twoBanks>
+void build_bank_header(SysexBank& splitData, const char* label) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  The format of the FB-01 bank sysex files we must create is structured like so:      //
+    //                                                                                      //
+    //  For bank A:                                                                         //
+    //  $00-                                                                                //
+    //   $06:   F0 43 75 00 00 00 00h.......FB-01's "send bank A" sysex code                //
+    //--------------------------------------------------------------------------------------//
+    //  For bank B:                                                                         //
+    //  $00-                                                                                //
+    //   $06:   F0 43 75 00 00 00 01h.......FB-01's "send bank B" sysex code                //
+    //--------------------------------------------------------------------------------------//
+    //  $07-                                                                                //
+    //   $08:   00 40h......................Bank info packet size (64)                      //
+    //  $19-                                                                                //
+    //   $48:   <bank description>..........8-byte string for name + reserved empty bytes   //
+    //  $49 :   Checksum....................2's complement of sum                           //
+    //  $4A-                                                                                //
+    //   $4B:   01 00h......................Bank voice #1 packet size (128)                 //         
+    //  $4C-                                                                                //
+    //   $CB:   <patch data>................Voice #1 patch data                             //
+    //  $CC :   Checksum....................2's complement of sum                           //
+    //    "          "                           "                                          //
+    //    "          "                           "                                          //
+    //    "     ....."......................Voice #48                                       // 
+    // $18DA:   F7h.........................End sysex                                       //
+    //                                                                                      //
+    //  The resulting files will each be exactly 6363 bytes long.                           //
+    //////////////////////////////////////////////////////////////////////////////////////////
+    
+    // Start from the precomputed header for this bank
+    char* header = splitData.data();
+    memcpy(header, bank_header_template<bank, twoBanks>.bytes, BANK_HEADER_SIZE);
+    unsigned int sum = bank_header_template<bank, twoBanks>.sum;
+
+    // Fill in the bank name, pulling it from the label (the output filename on the command line).
+    //
+    // WHEN TWO BANKS ARE BEING GENERATED:
+    // Only the first 7 char's of the label are used. If it is less than 7 char's already, the remaining spaces
+    // are filled with 0x20 (space character). The 8th character is already the bank number.
+    //
+    // WHEN ONE BANK IS BEING GENERATED:
+    // Use the first 8 char's of the label. Again, if it is less than 8 char's already, fill the remaining spaces
+    // with 0x20 (space character).
+    //
+    // Each character is uppercased and nibblized straight into the header, adding its nibbles to the checksum.
+    const int bank_name_maxlen = twoBanks ? 7 : 8;
+    char* name = header + 9;
+    int i = 0;
+    for (; i < bank_name_maxlen && label[i] != '\0'; i++) {
+        const unsigned char c = toupper(static_cast<unsigned char>(label[i]));
+        name[i * 2] = nibble_table.pair[c][0];
+        name[i * 2 + 1] = nibble_table.pair[c][1];
+        sum += nibble_table.sum[c];
+    }
+    for (; i < bank_name_maxlen; i++) {
+        name[i * 2] = nibble_table.pair[0x20][0];
+        name[i * 2 + 1] = nibble_table.pair[0x20][1];
+        sum += nibble_table.sum[0x20];
+    }
+
+    // Store the info packet's checksum at the end of the header in the last index
+    header[73] = ((~(sum & 0xFF)) + 1) & 0x7F;
+
+    // Complete the sysex image around the already nibblized and checksummed voice data packets
+    splitData.back() = '\xF7'; // Add the final closing byte to end the exclusive message
+}
+
+void build_bank_header(SysexBank& splitData, int bank, const char* label, bool twoBanks) {
+    if (!twoBanks) build_bank_header<0, false>(splitData, label);
+    else if (bank == 0) build_bank_header<0, true>(splitData, label);
+    else build_bank_header<1, true>(splitData, label);
+}
+
+PatchError parse_bank(const char* sysex, size_t length, RawBank& data, int& bank) {
+    // The exact layout build_bank_header and nibblize_data produce: "send bank" code, info packet, 48 voice
+    // packets and the closing F7h
+    static const char code[6] = { '\xF0', '\x43', '\x75', '\x00', '\x00', '\x00' };
+    if (length < BANK_SYSEX_SIZE || memcmp(sysex, code, sizeof(code)) != 0 || (sysex[6] != 0x00 && sysex[6] != 0x01)
+        || sysex[7] != 0x00 || sysex[8] != 0x40 || sysex[BANK_SYSEX_SIZE - 1] != '\xF7') {
+        return PatchError::InvalidSysex;
+    }
+    bank = sysex[6];
+
+    // Only the info packet's checksum matters, the bank name isn't stored in the patch resource
+    char infoPacket[32];
+    if (!denibblize_packet(sysex + 9, sizeof(infoPacket), infoPacket, sysex[73])) return PatchError::BadChecksum;
+
+    const char* packet = sysex + BANK_HEADER_SIZE;
+    for (int i = 0; i < VOICES_PER_BANK; i++, packet += VOICE_PACKET_SIZE) {
+        if (packet[0] != 0x01 || packet[1] != 0x00) return PatchError::InvalidSysex;
+        if (!denibblize_packet(packet + 2, VOICE_SIZE, data.data() + i * VOICE_SIZE, packet[130])) return PatchError::BadChecksum;
+    }
+    return PatchError::None;
+}
+
+bool denibblize_packet(const char* in, int nBytes, char* out, char checksum) {
+    // Joins the 2 * nBytes of nibbles at "in" (low nibble first) back into nBytes at "out", summing them on
+    // the way. Valid packets only hold nibbles, and their sum plus the checksum is 0 in the lowest 7 bits.
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(in);
+    unsigned int sum = 0;
+    unsigned int bits = 0;
+    for (int i = 0; i < nBytes; i++) {
+        unsigned char low = src[i * 2];
+        unsigned char high = src[i * 2 + 1];
+        out[i] = static_cast<char>(low | (high << 4));
+        sum += low + high;
+        bits |= low | high;
+    }
+    return (bits & 0xF0) == 0 && ((sum + static_cast<unsigned char>(checksum)) & 0x7F) == 0;
+}
+
+static bool check_packet(const char* in, int nBytes, char checksum) {
+    // Horizontal sum of the packet's nBytes (a multiple of 16), ORing them together on the way so any byte
+    // that isn't a nibble shows up. psadbw (SSE2) or pairwise widening adds (NEON) sum 16 bytes at a time.
+    const unsigned char* src = reinterpret_cast<const unsigned char*>(in);
+    unsigned int sum = 0;
+    unsigned int bits = 0;
+    int i = 0;
+
+#if defined(SCI2FB_SSE2)
+    const __m128i zero = _mm_setzero_si128();
+    __m128i acc = zero;
+    __m128i any = zero;
+    for (; i + 16 <= nBytes; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+        acc = _mm_add_epi64(acc, _mm_sad_epu8(bytes, zero));
+        any = _mm_or_si128(any, bytes);
+    }
+    sum += _mm_cvtsi128_si32(acc) + _mm_cvtsi128_si32(_mm_srli_si128(acc, 8));
+    // Any byte of 10h or more leaves a high nibble bit set in the OR of them all
+    bits |= (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(any, _mm_set1_epi8((char)0xF0)), zero)) != 0xFFFF) ? 0xF0 : 0;
+#elif defined(SCI2FB_NEON)
+    uint16x8_t acc = vdupq_n_u16(0);
+    uint8x16_t any = vdupq_n_u8(0);
+    for (; i + 16 <= nBytes; i += 16) {
+        uint8x16_t bytes = vld1q_u8(src + i);
+        acc = vpadalq_u8(acc, bytes);
+        any = vorrq_u8(any, bytes);
+    }
+    uint64x2_t acc64 = vpaddlq_u32(vpaddlq_u16(acc));
+    sum += static_cast<unsigned int>(vgetq_lane_u64(acc64, 0) + vgetq_lane_u64(acc64, 1));
+    uint8x8_t any8 = vorr_u8(vget_low_u8(any), vget_high_u8(any));
+    bits |= (vget_lane_u64(vreinterpret_u64_u8(any8), 0) & 0xF0F0F0F0F0F0F0F0ULL) ? 0xF0 : 0;
+#endif
+
+    for (; i < nBytes; i++) {
+        sum += src[i];
+        bits |= src[i];
+    }
+    return (bits & 0xF0) == 0 && ((sum + static_cast<unsigned char>(checksum)) & 0x7F) == 0;
+}
+
+int verify_bank(const char* sysex, size_t length, size_t* badOffsets, int maxBad) {
+    static const char code[6] = { '\xF0', '\x43', '\x75', '\x00', '\x00', '\x00' };
+    if (length < BANK_SYSEX_SIZE || memcmp(sysex, code, sizeof(code)) != 0 || (sysex[6] != 0x00 && sysex[6] != 0x01)
+        || sysex[7] != 0x00 || sysex[8] != 0x40 || sysex[BANK_SYSEX_SIZE - 1] != '\xF7') {
+        return -1;
+    }
+
+    int nBad = 0;
+    auto fail = [&](size_t offset) {
+        if (nBad < maxBad) badOffsets[nBad] = offset;
+        nBad++;
+    };
+
+    // The info packet's 64 nibbles start at offset 9, its checksum is the last header byte
+    if (!check_packet(sysex + 9, 64, sysex[BANK_HEADER_SIZE - 1])) fail(7);
+
+    for (int i = 0; i < VOICES_PER_BANK; i++) {
+        size_t offset = BANK_HEADER_SIZE + static_cast<size_t>(i) * VOICE_PACKET_SIZE;
+        const char* packet = sysex + offset;
+        if (packet[0] != 0x01 || packet[1] != 0x00 || !check_packet(packet + 2, VOICE_SIZE * 2, packet[130])) fail(offset);
+    }
+    return nBad;
+}
+
+size_t build_patch(const RawBank& data1, const RawBank* data2, char* image) {
+    // Patch resource identifier, then a title string length of 0 (bank dumps have no title to carry over)
+    image[0] = '\x89';
+    image[1] = 0x00;
+    memcpy(image + 0x02, data1.data(), data1.size());
+    if (!data2) return 3074;
+
+    // Bank B follows the ABCDh separator bytes at 0xC02
+    image[0xC02] = '\xAB';
+    image[0xC03] = '\xCD';
+    memcpy(image + 0xC04, (*data2).data(), (*data2).size());
+    return 6148;
+}
+
+size_t voice_offset(const PatchLayout& layout, int voice) {
+    return layout.voiceOffset[voice / VOICES_PER_BANK] + static_cast<size_t>(voice % VOICES_PER_BANK) * VOICE_SIZE;
+}
+
+void build_voice_message(const char* voice, int instrument, VoiceSysex& message) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  Voice data to instrument:                                                           //
+    //                                                                                      //
+    //  $00-                                                                                //
+    //   $06:   Sysex header................F0 43 75 00 (08h + instrument) 00 00            //
+    //  $07-                                                                                //
+    //   $89:   Voice packet................01 00, 128 nibbles, checksum (as in a bank)     //
+    //  $8A:    End of sysex................F7                                              //
+    //////////////////////////////////////////////////////////////////////////////////////////
+    const char header[VOICE_HEADER_SIZE] = { (char)0xF0, 0x43, 0x75, 0x00, static_cast<char>(0x08 + (instrument & 7)), 0x00, 0x00 };
+    memcpy(message.data(), header, sizeof(header));
+
+    char* packet = message.data() + VOICE_HEADER_SIZE;
+    packet[0] = 0x01;
+    packet[1] = 0x00;
+    packet[130] = nibblize_packet(voice, VOICE_SIZE, packet + 2);
+    message[VOICE_SYSEX_SIZE - 1] = (char)0xF7;
+}
+
+// Writes a MIDI variable-length quantity (7 bits per byte, most significant first) and returns its length
+static size_t write_var_length(unsigned long value, char* out) {
+    char bytes[4];
+    size_t n = 0;
+    do {
+        bytes[n++] = static_cast<char>(value & 0x7F);
+        value >>= 7;
+    } while (value && n < sizeof(bytes));
+    for (size_t i = 0; i < n; i++) out[i] = static_cast<char>(bytes[n - 1 - i] | ((i + 1 < n) ? 0x80 : 0));
+    return n;
+}
+
+size_t build_midi_file(const SysexBank& bankA, const SysexBank* bankB, int gapMs, char* file) {
+    //////////////////////////////////////////////////////////////////////////////////////////
+    //  Type 0 Standard MIDI File:                                                          //
+    //                                                                                      //
+    //  "MThd", length 6, format 0, 1 track, 480 ticks per quarter note                     //
+    //  "MTrk", track length, then the events:                                              //
+    //      delta 0........Set tempo, 500000 us per quarter note (120 bpm)                  //
+    //      delta 0........F0 <length> <bank A dump after its F0>                           //
+    //      delta n........F0 <length> <bank B dump after its F0>                           //
+    //      delta n........End of track                                                     //
+    //                                                                                      //
+    //  n is how long a bank takes on the wire plus the store gap, converted to ticks at    //
+    //  the file's tempo so a player sends bank B no sooner than the FB-01 can take it.     //
+    //////////////////////////////////////////////////////////////////////////////////////////
+    const unsigned long division = 480;
+    const unsigned long tempo = 500000;
+    // 10 bits per byte at 31250 baud is 320 us per byte
+    unsigned long bankUs = static_cast<unsigned long>(BANK_SYSEX_SIZE) * 320 + static_cast<unsigned long>(gapMs) * 1000;
+    unsigned long delta = bankUs * division / tempo;
+
+    const char header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, static_cast<char>(division >> 8), static_cast<char>(division & 0xFF),
+                            'M', 'T', 'r', 'k', 0, 0, 0, 0 };
+    memcpy(file, header, sizeof(header));
+    char* pos = file + sizeof(header);
+
+    const char setTempo[] = { 0x00, (char)0xFF, 0x51, 0x03, static_cast<char>(tempo >> 16), static_cast<char>((tempo >> 8) & 0xFF), static_cast<char>(tempo & 0xFF) };
+    memcpy(pos, setTempo, sizeof(setTempo));
+    pos += sizeof(setTempo);
+
+    // The event's F0 status byte comes first, and its length counts everything after it up to and including F7
+    for (const SysexBank* bank : { &bankA, bankB }) {
+        if (!bank) continue;
+        pos += write_var_length((bank == &bankA) ? 0 : delta, pos);
+        *pos++ = (char)0xF0;
+        pos += write_var_length(BANK_SYSEX_SIZE - 1, pos);
+        memcpy(pos, (*bank).data() + 1, BANK_SYSEX_SIZE - 1);
+        pos += BANK_SYSEX_SIZE - 1;
+    }
+
+    pos += write_var_length(delta, pos);
+    const char endOfTrack[] = { (char)0xFF, 0x2F, 0x00 };
+    memcpy(pos, endOfTrack, sizeof(endOfTrack));
+    pos += sizeof(endOfTrack);
+
+    // Track chunk length, big endian
+    size_t trackLength = pos - (file + sizeof(header));
+    for (int i = 0; i < 4; i++) file[sizeof(header) - 1 - i] = static_cast<char>((trackLength >> (i * 8)) & 0xFF);
+    return pos - file;
+}
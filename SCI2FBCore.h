@@ -0,0 +1,157 @@
+/************************************************************************
+*   SCI2FB conversion core                                              *
+*                                                                       *
+*   The patch resource to FB-01 sysex bank conversion on its own, so    *
+*   it can be linked into other programs. Everything here works on      *
+*   caller-provided memory: nothing reads or writes files, prints or    *
+*   exits.                                                              *
+************************************************************************/
+
+#ifndef SCI2FB_CORE_H
+#define SCI2FB_CORE_H
+
+#include <array>
+#include <cstddef>
+
+// Padded patch files are filled out to a whole number of these blocks
+const size_t PADDING_BLOCK_SIZE = 128;
+
+// Largest valid patch file: two banks plus the longest title string the length byte can describe, padded out
+// to a whole block
+const size_t MAX_PATCH_SIZE = (6148 + 255 + PADDING_BLOCK_SIZE - 1) / PADDING_BLOCK_SIZE * PADDING_BLOCK_SIZE;
+
+// Fixed sizes of the FB-01 bank format
+const int VOICES_PER_BANK = 48;
+const int VOICE_SIZE = 64;              // Raw voice data as stored in the patch resource
+const int VOICE_PACKET_SIZE = 131;      // Packet size bytes + 128 nibbles + checksum
+const int BANK_HEADER_SIZE = 74;        // Sysex header + nibblized info packet + checksum
+const size_t BANK_SYSEX_SIZE = BANK_HEADER_SIZE + VOICES_PER_BANK * VOICE_PACKET_SIZE + 1;
+const int VOICE_HEADER_SIZE = 7;        // Sysex header of a single voice message
+const size_t VOICE_SYSEX_SIZE = VOICE_HEADER_SIZE + VOICE_PACKET_SIZE + 1;
+
+// Largest Standard MIDI File build_midi_file makes: the headers, a tempo event, and two bank sysex events
+// with their delta times and lengths
+const size_t MAX_MIDI_FILE_SIZE = 64 + 2 * (BANK_SYSEX_SIZE + 8);
+
+// One bank's 48 raw voices, and the complete 6363-byte sysex bank dump generated from them
+typedef std::array<char, VOICES_PER_BANK * VOICE_SIZE> RawBank;
+typedef std::array<char, BANK_SYSEX_SIZE> SysexBank;
+typedef std::array<char, VOICE_SYSEX_SIZE> VoiceSysex;
+
+// Why a patch resource image was rejected
+enum class PatchError {
+    None,
+    InvalidHeader,          // Missing the 0x89 patch resource identifier
+    InvalidSize,            // Not 3074 or 6148 bytes + title string length
+    MissingSeparator,       // Two bank patch without the ABCDh bytes between the banks
+    InvalidSysex,           // Not an FB-01 bank dump (wrong sysex header, packet sizes or length)
+    BadChecksum,            // A bank dump packet's checksum doesn't match its data
+};
+
+const char* patch_error_message(PatchError error);
+
+// Validates a patch resource image. On success nBanks is set to 1 or 2.
+PatchError check_patch(const char* image, size_t length, int& nBanks);
+
+// The same checks without the whole image: check_patch_header needs only the first two bytes of the patch
+// and its total length, and two bank patches then need check_separator on the two bytes at
+// separator_offset(). Together they let a file be validated from a couple of small reads.
+PatchError check_patch_header(const char* header, size_t length, int& nBanks);
+PatchError check_separator(const char* separator);
+size_t separator_offset(size_t titleOffset);
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  Patch variants. Collections mix SCI0 patch resources with files laid out a little   //
+//  differently, so each image is first classified from its first two bytes and its     //
+//  length alone (FORMAT_HEADER_SIZE bytes and a size, as a directory entry gives it),  //
+//  and then read through the layout its variant describes. Where the voices sit is    //
+//  all that differs; every variant goes through the same nibblizing and bank headers. //
+//  Adding a variant takes a detector in SCI2FBCore.cpp and an entry in its table.      //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+enum class PatchFormat {
+    Sci0,                   // 0x89, title length, title, bank A, then ABCDh and bank B; nothing else
+    Padded,                 // A one or two bank SCI0 layout padded with 00h or 1Ah out to a 128-byte block boundary
+    Raw,                    // Headerless voices: 3072 bytes, or 6144 (6146 with ABCDh between the banks); opt-in
+    Volume,                 // A patch resource as stored in a RESOURCE.00x volume: bank A, then ABCDh and bank B
+};
+
+const char* patch_format_name(PatchFormat format);
+
+const size_t FORMAT_HEADER_SIZE = 2;
+
+// Where a patch image of a recognized variant keeps its voices
+struct PatchLayout {
+    PatchFormat format = PatchFormat::Sci0;
+    int nBanks = 0;
+    size_t voiceOffset[2] = {};     // Start of each bank's 48 voices
+    size_t separatorOffset = 0;     // The ABCDh bytes between the banks, or 0 for a layout without them
+    size_t paddingOffset = 0;       // Start of the block padding after the banks, or 0 for none
+};
+
+// Classifies the image that starts with "header" (FORMAT_HEADER_SIZE bytes, or fewer when "length" is less)
+// and is "length" bytes long. Anything none of the variants take gets the SCI0 check's error. A two bank
+// layout with a separator still needs check_separator on the two bytes at separatorOffset, and a padded one
+// check_padding on the bytes from paddingOffset to the end.
+// Raw voice dumps have nothing but their size to tell them by, so any file of the right size would pass as
+// one; they're only taken with "allowRaw", when the caller knows its inputs are voice dumps.
+PatchError detect_patch_format(const char* header, size_t length, PatchLayout& layout, bool allowRaw = false);
+PatchError check_padding(const char* padding, size_t length);
+
+// Both steps on a whole image in memory
+PatchError find_patch_layout(const char* image, size_t length, PatchLayout& layout, bool allowRaw = false);
+
+// A patch resource unpacked from a game's resource volume has no patch file header to detect it by (only a
+// stand-alone PATCH.002 carries the 0x89 and title length bytes), so a caller that knows where the image came
+// from gets its layout here instead: 3072 bytes for one bank, or 6146 with the separator between two.
+PatchError volume_patch_layout(const char* image, size_t length, PatchLayout& layout);
+
+// Copies the voices out of an image through its layout
+void read_patch(const char* image, const PatchLayout& layout, RawBank& data1, RawBank* data2 = nullptr);
+
+// Converts a whole patch resource image, of any variant, into sysex bank images. outB is only filled for two
+// bank patches.
+// "label" names the bank(s) the same way an output filename does on the command line; bank B uses "labelB"
+// instead when one is given.
+PatchError convert_patch(const char* image, size_t length, const char* label, SysexBank& outA, SysexBank& outB,
+                         int& nBanks, const char* labelB = nullptr, bool allowRaw = false);
+
+// The same for an image whose layout is already known
+void convert_patch(const char* image, const PatchLayout& layout, const char* label, SysexBank& outA, SysexBank& outB,
+                   const char* labelB = nullptr);
+
+// The individual conversion stages
+void nibblize_data(const RawBank& data, SysexBank& splitData);
+unsigned char nibblize_packet(const char* in, int nBytes, char* out);
+void build_bank_header(SysexBank& splitData, int bank, const char* label, bool twoBanks);
+
+// Reverse conversion, FB-01 bank dumps back to an SCI0 patch resource.
+//
+// parse_bank reads the bank dump at the start of "sysex" (at least BANK_SYSEX_SIZE bytes), verifying the
+// info packet's and every voice packet's checksum while denibblizing the voices into "data". "bank" is set
+// to the dump's bank number, 0 for bank A or 1 for bank B.
+//
+// build_patch writes an SCI0 patch resource holding one or two banks of voices (with an empty title) into
+// "image", which must hold at least 6148 bytes, and returns its length.
+PatchError parse_bank(const char* sysex, size_t length, RawBank& data, int& bank);
+bool denibblize_packet(const char* in, int nBytes, char* out, char checksum);
+size_t build_patch(const RawBank& data1, const RawBank* data2, char* image);
+
+// Checks a bank dump in place without decoding it: the fixed layout around the packets, then the checksum of
+// the info packet and of every voice packet, and that their payloads only hold nibbles. The offsets (from
+// the start of "sysex") of the packets that fail go into "badOffsets", up to maxBad of them. Returns the
+// number of failed packets, or -1 when "sysex" doesn't start with an FB-01 bank dump at all.
+int verify_bank(const char* sysex, size_t length, size_t* badOffsets, int maxBad);
+
+// Wraps one or two bank dumps in a type 0 Standard MIDI File as sysex events, bank B following bank A once
+// it has had time to cross a 31250 baud MIDI cable plus "gapMs" for the synth to store it. "file" must hold
+// MAX_MIDI_FILE_SIZE bytes. Returns the file's length.
+size_t build_midi_file(const SysexBank& bankA, const SysexBank* bankB, int gapMs, char* file);
+
+// Single voices. Voices are numbered 0-95 across both banks; voice_offset gives where a voice's 64 bytes
+// start in a patch resource of the given layout. build_voice_message makes the FB-01 "voice data to
+// instrument" message that loads one voice into instrument 0-7.
+size_t voice_offset(const PatchLayout& layout, int voice);
+void build_voice_message(const char* voice, int instrument, VoiceSysex& message);
+
+#endif
@@ -0,0 +1,100 @@
+/************************************************************************
+*   SCI2FB memory-mapped files                                          *
+*                                                                       *
+*   See SCI2FBMap.h                                                     *
+************************************************************************/
+
+#include "SCI2FBMap.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#include <filesystem>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using namespace std;
+
+MappedFile::~MappedFile() {
+    close();
+}
+
+#ifdef _WIN32
+
+bool MappedFile::open(const string& filename) {
+    close();
+    HANDLE file = CreateFileW(filesystem::path(filename).wstring().c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+                              OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+    if (file == INVALID_HANDLE_VALUE) return false;
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(file, &size)) {
+        CloseHandle(file);
+        return false;
+    }
+    length = static_cast<size_t>(size.QuadPart);
+    if (length == 0) {
+        CloseHandle(file);
+        return true;
+    }
+
+    // The mapping keeps the file open, so the file handle can go straight away
+    mapping = CreateFileMappingW(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+    CloseHandle(file);
+    if (!mapping) return false;
+    base = static_cast<const char*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0));
+    if (!base) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+void MappedFile::close() {
+    if (base) UnmapViewOfFile(base);
+    if (mapping) CloseHandle(mapping);
+    base = nullptr;
+    mapping = nullptr;
+    length = 0;
+}
+
+#else
+
+bool MappedFile::open(const string& filename) {
+    close();
+    int fd = ::open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        ::close(fd);
+        return false;
+    }
+    length = static_cast<size_t>(st.st_size);
+    if (length == 0) {
+        ::close(fd);
+        return true;
+    }
+
+    // The mapping keeps the file open, so the descriptor can go straight away. The whole file is read
+    // front to back, so ask for it to be read ahead in one go.
+    void* map = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+        length = 0;
+        return false;
+    }
+    madvise(map, length, MADV_SEQUENTIAL);
+    madvise(map, length, MADV_WILLNEED);
+    base = static_cast<const char*>(map);
+    return true;
+}
+
+void MappedFile::close() {
+    if (base) munmap(const_cast<char*>(base), length);
+    base = nullptr;
+    length = 0;
+}
+
+#endif
@@ -0,0 +1,36 @@
+/************************************************************************
+*   SCI2FB memory-mapped files                                          *
+*                                                                       *
+*   Read-only mapping of a whole file, so large files can be checked    *
+*   in place without being copied into buffers first.                   *
+************************************************************************/
+
+#ifndef SCI2FB_MAP_H
+#define SCI2FB_MAP_H
+
+#include <cstddef>
+#include <string>
+
+class MappedFile {
+public:
+    MappedFile() = default;
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+    ~MappedFile();
+
+    // Maps "filename" read-only. An empty file maps to no data and a size of 0.
+    bool open(const std::string& filename);
+    void close();
+
+    const char* data() const { return base; }
+    size_t size() const { return length; }
+
+private:
+    const char* base = nullptr;
+    size_t length = 0;
+#ifdef _WIN32
+    void* mapping = nullptr;
+#endif
+};
+
+#endif
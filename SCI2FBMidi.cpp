@@ -0,0 +1,126 @@
+/************************************************************************
+*   SCI2FB MIDI output                                                  *
+*                                                                       *
+*   See SCI2FBMidi.h                                                    *
+************************************************************************/
+
+#include "SCI2FBMidi.h"
+
+#include <chrono>
+#include <cstdlib>
+#include <thread>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <mmsystem.h>
+#pragma comment(lib, "winmm.lib")
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sound/asound.h>
+#endif
+
+using namespace std;
+
+MidiOut::~MidiOut() {
+#ifdef _WIN32
+    if (handle) midiOutClose(static_cast<HMIDIOUT>(handle));
+#else
+    if (fd >= 0) close(fd);
+#endif
+}
+
+bool MidiOut::is_open() const {
+#ifdef _WIN32
+    return handle != nullptr;
+#else
+    return fd >= 0;
+#endif
+}
+
+#ifdef _WIN32
+
+bool MidiOut::open(const string& port, string& error) {
+    HMIDIOUT out = nullptr;
+    UINT device = static_cast<UINT>(atoi(port.c_str()));
+    if (midiOutOpen(&out, device, 0, 0, CALLBACK_NULL) != MMSYSERR_NOERROR) {
+        error = "could not open MIDI output device " + port;
+        return false;
+    }
+    handle = out;
+    return true;
+}
+
+bool MidiOut::send(const char* data, size_t length) {
+    // WinMM only hands a long message back once it has left the port, so waiting for MHDR_DONE is
+    // what makes the pause after each chunk count from the end of the transmission
+    HMIDIOUT out = static_cast<HMIDIOUT>(handle);
+    MIDIHDR header = {};
+    header.lpData = const_cast<LPSTR>(data);
+    header.dwBufferLength = static_cast<DWORD>(length);
+    if (midiOutPrepareHeader(out, &header, sizeof(header)) != MMSYSERR_NOERROR) return false;
+    bool sent = (midiOutLongMsg(out, &header, sizeof(header)) == MMSYSERR_NOERROR);
+    while (sent && !(header.dwFlags & MHDR_DONE)) Sleep(1);
+    midiOutUnprepareHeader(out, &header, sizeof(header));
+    return sent;
+}
+
+#else
+
+bool MidiOut::open(const string& port, string& error) {
+    // "hw:card,device[,subdevice]" and a bare card number map onto the rawmidi device node. Opening the node
+    // directly needs nothing beyond the kernel headers, so there's no libasound dependency.
+    string path = port;
+    if (port.compare(0, 3, "hw:") == 0 || port.find_first_not_of("0123456789") == string::npos) {
+        const char* spec = port.c_str() + (port.compare(0, 3, "hw:") == 0 ? 3 : 0);
+        char* end = nullptr;
+        long card = strtol(spec, &end, 10);
+        long device = (*end == ',') ? strtol(end + 1, nullptr, 10) : 0;
+        path = "/dev/snd/midiC" + to_string(card) + "D" + to_string(device);
+    }
+
+    fd = ::open(path.c_str(), O_WRONLY);
+    if (fd < 0) {
+        error = "could not open MIDI port " + path;
+        return false;
+    }
+    return true;
+}
+
+bool MidiOut::send(const char* data, size_t length) {
+    while (length > 0) {
+        ssize_t n = write(fd, data, length);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    // write() returns as soon as the rawmidi buffer has the data. Draining waits until it has actually left
+    // the port, so the pause after each chunk counts from the end of the transmission. Devices other than
+    // rawmidi nodes don't support the drain, and are paced from the write instead.
+    int stream = SNDRV_RAWMIDI_STREAM_OUTPUT;
+    ioctl(fd, SNDRV_RAWMIDI_IOCTL_DRAIN, &stream);
+    return true;
+}
+
+#endif
+
+bool MidiOut::send_bank(const SysexBank& bank, const MidiPacing& pacing) {
+    lock_guard<mutex> lock(port_mutex);
+    const char* data = bank.data();
+    size_t length = bank.size();
+    size_t pos = 0;
+    while (pos < length) {
+        // Per voice, the chunks follow the bank layout: the header, then each voice packet, with the
+        // closing F7h riding along with the last packet
+        size_t chunk = length - pos;
+        if (pacing.perVoice) chunk = (pos == 0) ? BANK_HEADER_SIZE : VOICE_PACKET_SIZE + ((length - pos == VOICE_PACKET_SIZE + 1) ? 1 : 0);
+        else if (pacing.chunkSize > 0 && pacing.chunkSize < chunk) chunk = pacing.chunkSize;
+
+        if (!send(data + pos, chunk)) return false;
+        pos += chunk;
+        if (pos < length) this_thread::sleep_for(chrono::milliseconds(pacing.delayMs));
+    }
+    this_thread::sleep_for(chrono::milliseconds(MIDI_BANK_GAP_MS));
+    return true;
+}
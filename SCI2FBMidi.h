@@ -0,0 +1,51 @@
+/************************************************************************
+*   SCI2FB MIDI output                                                  *
+*                                                                       *
+*   Sends generated sysex banks straight to an FB-01 or IMFC on a MIDI  *
+*   port, paced so the synth's small input buffer never overflows.      *
+*   Uses ALSA rawmidi devices on Linux and WinMM on Windows.            *
+************************************************************************/
+
+#ifndef SCI2FB_MIDI_H
+#define SCI2FB_MIDI_H
+
+#include "SCI2FBCore.h"
+
+#include <mutex>
+#include <string>
+
+// How a bank dump is split up on the wire
+struct MidiPacing {
+    size_t chunkSize = 128;     // Bytes sent before each pause (0 sends the whole bank in one go)
+    int delayMs = 20;           // Pause after each chunk, once it has left the port
+    bool perVoice = false;      // Send the header and then each 131-byte voice packet on its own instead
+};
+
+// Pause after a whole bank, giving the FB-01 time to store it before the next one arrives
+const int MIDI_BANK_GAP_MS = 200;
+
+class MidiOut {
+public:
+    ~MidiOut();
+
+    // Opens a MIDI output port. On Linux "port" is an ALSA hw name ("hw:1,0"), a card number or a device
+    // path such as /dev/snd/midiC1D0; on Windows it is a WinMM output device number.
+    bool open(const std::string& port, std::string& error);
+    bool is_open() const;
+
+    // Sends one complete sysex bank dump, paced as set up. Calls from several threads are sent one whole
+    // bank after another.
+    bool send_bank(const SysexBank& bank, const MidiPacing& pacing);
+
+private:
+    bool send(const char* data, size_t length);
+
+    std::mutex port_mutex;
+#ifdef _WIN32
+    void* handle = nullptr;
+#else
+    int fd = -1;
+#endif
+};
+
+#endif
@@ -0,0 +1,142 @@
+/************************************************************************
+*   SCI2FB quiet conversion                                             *
+*                                                                       *
+*   See SCI2FBQuiet.h                                                   *
+************************************************************************/
+
+#include "SCI2FBQuiet.h"
+#include "SCI2FBCore.h"
+
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/stat.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <io.h>
+#include <process.h>
+#define open _open
+#define read _read
+#define write _write
+#define close _close
+#define getpid _getpid
+#else
+#include <unistd.h>
+#define O_BINARY 0
+#endif
+
+// Up to "size" bytes, however many reads the file takes to hand them over. Returns -1 on a read error.
+static long long read_all(int fd, char* buffer, size_t size) {
+    size_t total = 0;
+    while (total < size) {
+        long long n = read(fd, buffer + total, static_cast<unsigned>(size - total));
+        if (n < 0) return -1;
+        if (n == 0) break;
+        total += static_cast<size_t>(n);
+    }
+    return static_cast<long long>(total);
+}
+
+static bool write_all(int fd, const char* data, size_t length) {
+    while (length > 0) {
+        long long n = write(fd, data, static_cast<unsigned>(length));
+        if (n <= 0) return false;
+        data += n;
+        length -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+static bool file_exists(const char* filename) {
+    struct stat info;
+    return stat(filename, &info) == 0;
+}
+
+static bool same_contents(const SysexBank& bank, const char* filename) {
+    int fd = open(filename, O_RDONLY | O_BINARY);
+    if (fd < 0) return false;
+    // One byte more than a bank, so a longer file doesn't compare equal
+    char existing[BANK_SYSEX_SIZE + 1];
+    long long length = read_all(fd, existing, sizeof(existing));
+    close(fd);
+    return length == static_cast<long long>(bank.size()) && memcmp(existing, bank.data(), bank.size()) == 0;
+}
+
+static bool write_bank(const SysexBank& bank, const char* filename, QuietOverwrite overwrite) {
+    if (overwrite == QuietOverwrite::SkipExisting && file_exists(filename)) return true;
+    if (overwrite == QuietOverwrite::IfChanged && same_contents(bank, filename)) return true;
+
+    // Written to a temporary file and renamed over the bank, as write_image does, so a failed write never
+    // leaves a half-written bank behind
+    char temp_name[280];
+    snprintf(temp_name, sizeof(temp_name), "%s.%d.tmp", filename, static_cast<int>(getpid()));
+    int fd = open(temp_name, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0666);
+    if (fd < 0) return false;
+    bool written = write_all(fd, bank.data(), bank.size());
+    written = (close(fd) == 0) && written;
+#ifdef _WIN32
+    written = written && MoveFileExA(temp_name, filename, MOVEFILE_REPLACE_EXISTING);
+#else
+    written = written && rename(temp_name, filename) == 0;
+#endif
+    if (!written) remove(temp_name);
+    return written;
+}
+
+int convert_quiet(const char* patfile_name, const char* output_bank_name, bool toStdout, QuietOverwrite overwrite, bool allowRaw) {
+    char output_bank[256];
+    if (strlen(output_bank_name) >= sizeof(output_bank) - 6) return QUIET_FAILED;
+    strcpy(output_bank, output_bank_name);
+    if (char* ext_pos = strrchr(output_bank, '.')) *ext_pos = '\0';
+
+    // The whole patfile in one read, plus a byte so an oversized file can't pass for an exact SCI0 size
+    char image[MAX_PATCH_SIZE + 1];
+    long long length = 0;
+    if (strcmp(patfile_name, "-") == 0) {
+#ifdef _WIN32
+        _setmode(0, _O_BINARY);
+#endif
+        length = read_all(0, image, sizeof(image));
+    }
+    else {
+        int fd = open(patfile_name, O_RDONLY | O_BINARY);
+        if (fd < 0) return QUIET_FAILED;
+        length = read_all(fd, image, sizeof(image));
+        close(fd);
+    }
+    if (length < 0) return QUIET_FAILED;
+
+    // Labelled from the output filenames, as they are on the normal path
+    char output_bank1[256];
+    char output_bank2[256];
+    snprintf(output_bank1, sizeof(output_bank1), "%s_a.syx", output_bank);
+    snprintf(output_bank2, sizeof(output_bank2), "%s_b.syx", output_bank);
+    char output_single[256];
+    snprintf(output_single, sizeof(output_single), "%s.syx", output_bank);
+
+    // The variant says how many banks there are, and so which labels they get
+    PatchLayout layout;
+    if (find_patch_layout(image, static_cast<size_t>(length), layout, allowRaw) != PatchError::None) return QUIET_FAILED;
+    bool twoBanks = (layout.nBanks == 2);
+    SysexBank splitData1;
+    SysexBank splitData2;
+    convert_patch(image, layout, twoBanks ? output_bank1 : output_single, splitData1, splitData2, twoBanks ? output_bank2 : nullptr);
+
+    if (toStdout) {
+#ifdef _WIN32
+        _setmode(1, _O_BINARY);
+#endif
+        bool written = write_all(1, splitData1.data(), splitData1.size()) && (!twoBanks || write_all(1, splitData2.data(), splitData2.size()));
+        return written ? QUIET_OK : QUIET_FAILED;
+    }
+
+    // Both files are checked before either is written, so a refusal leaves the pair as it was
+    if (overwrite == QuietOverwrite::Refuse &&
+        (twoBanks ? file_exists(output_bank1) || file_exists(output_bank2) : file_exists(output_single))) {
+        return QUIET_FAILED;
+    }
+    bool written = twoBanks ? write_bank(splitData1, output_bank1, overwrite) && write_bank(splitData2, output_bank2, overwrite)
+                            : write_bank(splitData1, output_single, overwrite);
+    return written ? QUIET_OK : QUIET_FAILED;
+}
@@ -0,0 +1,29 @@
+/************************************************************************
+*   SCI2FB quiet conversion                                             *
+*                                                                       *
+*   The plain patfile to bank file conversion for --quiet, done with    *
+*   raw POSIX or Win32 file I/O and no streams, so a run called from a  *
+*   script costs little more than its reads and writes.                 *
+************************************************************************/
+
+#ifndef SCI2FB_QUIET_H
+#define SCI2FB_QUIET_H
+
+// What to do with a bank file that already exists. There's no one to ask, so where the normal path would
+// prompt the conversion refuses instead.
+enum class QuietOverwrite {
+    Refuse,
+    Force,
+    SkipExisting,
+    IfChanged,
+};
+
+const int QUIET_OK = 0;
+const int QUIET_FAILED = 1;
+
+// Converts "patfile_name" ("-" for stdin) into bank files named and labelled from "output_bank", exactly as
+// convert_patch_image does, or writes the banks to stdout with "toStdout". Prints nothing. "allowRaw" also
+// takes headerless voice dumps, as --raw does.
+int convert_quiet(const char* patfile_name, const char* output_bank, bool toStdout, QuietOverwrite overwrite, bool allowRaw);
+
+#endif
@@ -0,0 +1,99 @@
+/************************************************************************
+*   SCI2FB input file resolver                                          *
+*                                                                       *
+*   See SCI2FBResolve.h                                                 *
+************************************************************************/
+
+#include "SCI2FBResolve.h"
+
+#include <algorithm>
+#include <cctype>
+#include <filesystem>
+
+using namespace std;
+
+static string lowercase(string name) {
+    for (char& c : name) c = static_cast<char>(tolower(static_cast<unsigned char>(c)));
+    return name;
+}
+
+// The entry in "files" matching "name" ignoring case, preferring one that matches exactly
+static const string* match(const unordered_map<string, vector<string>>& files, const string& name) {
+    auto entry = files.find(lowercase(name));
+    if (entry == files.end()) return nullptr;
+    auto exact = find(entry->second.begin(), entry->second.end(), name);
+    return (exact != entry->second.end()) ? &*exact : &entry->second.front();
+}
+
+const FileResolver::Listing* FileResolver::listing(const string& dir) {
+    // Listed once, on first use. A directory that can't be read is remembered as empty.
+    auto cached = listings.find(dir);
+    if (cached != listings.end()) return &cached->second;
+    Listing& files = listings[dir];
+    error_code ec;
+    for (const auto& entry : filesystem::directory_iterator(dir.empty() ? "." : dir, ec)) {
+        if (!entry.is_regular_file(ec)) continue;
+        string file = entry.path().filename().string();
+        files[lowercase(file)].push_back(file);
+    }
+    return &files;
+}
+
+bool FileResolver::find_dir(const string& dir, string& found) {
+    // The directory as written when it exists, otherwise its parent's subdirectory of the same name in any
+    // case, the parent of a bare name being the current directory. Either way the answer is remembered.
+    auto cached = dirs.find(dir);
+    if (cached != dirs.end()) {
+        found = cached->second;
+        return !found.empty() || dir.empty();
+    }
+    error_code ec;
+    filesystem::path path(dir);
+    bool ok = dir.empty() || filesystem::is_directory(path, ec);
+    found = dir;
+    if (!ok && path.has_filename()) {
+        string parent;
+        if (find_dir(path.parent_path().string(), parent)) {
+            string key = lowercase(path.filename().string());
+            for (const auto& entry : filesystem::directory_iterator(parent.empty() ? "." : parent, ec)) {
+                string name = entry.path().filename().string();
+                if (!entry.is_directory(ec) || lowercase(name) != key) continue;
+                found = (filesystem::path(parent) / name).string();
+                ok = true;
+                if (name == path.filename().string()) break;
+            }
+        }
+    }
+    if (!ok) found.clear();
+    dirs[dir] = found;
+    return ok;
+}
+
+bool FileResolver::resolve(string& name) {
+    lock_guard<mutex> lock(resolver_mutex);
+    filesystem::path path(name);
+    string dir;
+    if (!find_dir(path.parent_path().string(), dir)) return false;
+    const Listing* files = listing(dir);
+
+    string file = path.filename().string();
+    vector<string> candidates = { file };
+    if (file.find('.') == string::npos) {
+        candidates.push_back(file + ".pat");
+        candidates.push_back(file + ".002");
+    }
+    for (const string& candidate : candidates) {
+        const string* found = match(*files, candidate);
+        if (!found) continue;
+        // A name that was right as written keeps its spelling, since the bank labels are made from it
+        if (*found == candidate && dir == path.parent_path().string()) name += candidate.substr(file.size());
+        else name = dir.empty() ? *found : (filesystem::path(dir) / *found).string();
+        return true;
+    }
+    return false;
+}
+
+FILE* FileResolver::open(string& name) {
+    if (!resolve(name)) return nullptr;
+    return fopen(name.c_str(), "rb");
+}
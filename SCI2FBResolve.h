@@ -0,0 +1,42 @@
+/************************************************************************
+*   SCI2FB input file resolver                                          *
+*                                                                       *
+*   Finds patch files the way DOS did, ignoring case and trying the     *
+*   usual extensions, from cached directory listings rather than one    *
+*   failed open per guess.                                              *
+************************************************************************/
+
+#ifndef SCI2FB_RESOLVE_H
+#define SCI2FB_RESOLVE_H
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class FileResolver {
+public:
+    // Finds the file "name" refers to and replaces it with the file's real path. A name without an extension
+    // is tried as given, then with ".pat", then with ".002". Each name is matched against its directory's
+    // listing ignoring case, preferring an exact match, so "patch" finds PATCH.002. Directories along the
+    // way are matched the same way when they don't exist as written. Safe to call from several threads.
+    bool resolve(std::string& name);
+
+    // Resolves "name" the same way and opens the file found for binary reading, so the file is opened once
+    // in all. Returns nullptr when nothing matches or the file can't be opened.
+    FILE* open(std::string& name);
+
+private:
+    // A directory's regular files by lowercased name, each with every name that lowercases to it
+    typedef std::unordered_map<std::string, std::vector<std::string>> Listing;
+
+    std::mutex resolver_mutex;
+    std::unordered_map<std::string, Listing> listings;
+    std::unordered_map<std::string, std::string> dirs;      // Directory as written to where it really is
+
+    bool find_dir(const std::string& dir, std::string& found);
+    const Listing* listing(const std::string& dir);
+};
+
+#endif
@@ -0,0 +1,413 @@
+/************************************************************************
+*   SCI2FB resource volume access                                       *
+*                                                                       *
+*   SCI0 RESOURCE.MAP lookup, resource decompression and the cached     *
+*   per-game map index. See SCI2FBResource.h                            *
+************************************************************************/
+
+#include "SCI2FBResource.h"
+#include "SCI2FBZip.h"
+
+#include <fstream>
+#include <cstdio>
+#include <sstream>
+#include <vector>
+#include <cctype>
+#include <algorithm>
+#include <filesystem>
+
+using namespace std;
+
+const char* INDEX_FILENAME = "SCI2FB.IDX";
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  SCI0 RESOURCE.MAP is a list of 6-byte entries, terminated by one filled with FFh:   //
+//                                                                                      //
+//  $00-                                                                                //
+//   $01:   Resource ID.................type << 11 | number (little endian)             //
+//  $02-                                                                                //
+//   $05:   Location....................volume << 26 | offset (little endian)           //
+//                                                                                      //
+//  Each resource in a RESOURCE.00x volume starts with an 8-byte header:                //
+//                                                                                      //
+//  $00-                                                                                //
+//   $01:   Resource ID.................same as in the map                              //
+//  $02-                                                                                //
+//   $03:   Packed size.................size of the packed data + 4                     //
+//  $04-                                                                                //
+//   $05:   Unpacked size...............size of the resource once unpacked              //
+//  $06-                                                                                //
+//   $07:   Method......................0 = none, 1 = LZW, 2 = Huffman                  //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+static uint16_t read_le16(const char* p) {
+    return static_cast<uint16_t>(static_cast<unsigned char>(p[0]) | (static_cast<unsigned char>(p[1]) << 8));
+}
+
+static uint32_t read_le32(const char* p) {
+    return read_le16(p) | (static_cast<uint32_t>(read_le16(p + 2)) << 16);
+}
+
+// Archive entry names are matched ignoring case, as ZipArchive::find does
+static bool same_name(const string& a, const string& b) {
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return toupper(static_cast<unsigned char>(x)) == toupper(static_cast<unsigned char>(y));
+    });
+}
+
+bool find_resource(const char* map, size_t length, int type, int number, ResourceLocation& location) {
+    const uint16_t id = static_cast<uint16_t>((type << 11) | number);
+    for (size_t pos = 0; pos + 6 <= length; pos += 6) {
+        uint16_t entry_id = read_le16(map + pos);
+        uint32_t entry_location = read_le32(map + pos + 2);
+        if (entry_id == 0xFFFF && entry_location == 0xFFFFFFFF) break;
+        if (entry_id == id) {
+            location.volume = static_cast<int>(entry_location >> 26);
+            location.offset = entry_location & 0x03FFFFFF;
+            return true;
+        }
+    }
+    return false;
+}
+
+// Bit reader over packed resource data. LZW packs its codes starting from the lowest bit of each byte,
+// Huffman from the highest.
+struct BitReader {
+    const unsigned char* data;
+    size_t length;
+    size_t bitPos;
+
+    bool finished() const { return bitPos >= length * 8; }
+
+    unsigned int get_bits_lsb(int n) {
+        unsigned int value = 0;
+        for (int i = 0; i < n && !finished(); i++, bitPos++) {
+            value |= ((data[bitPos >> 3] >> (bitPos & 7)) & 1u) << i;
+        }
+        return value;
+    }
+
+    unsigned int get_bits_msb(int n) {
+        unsigned int value = 0;
+        for (int i = 0; i < n && !finished(); i++, bitPos++) {
+            value = (value << 1) | ((data[bitPos >> 3] >> (7 - (bitPos & 7))) & 1u);
+        }
+        return value;
+    }
+};
+
+static bool unpack_lzw(const unsigned char* in, size_t inLength, unsigned char* out, size_t outLength) {
+    // Codes start at 9 bits and grow to 12. 100h resets the dictionary, 101h ends the data. Every other
+    // code above FFh repeats an earlier string plus the byte that followed it.
+    BitReader bits = { in, inLength, 0 };
+    vector<uint16_t> tokenStart(4096);
+    vector<uint16_t> tokenLength(4096);
+    int numBits = 9;
+    unsigned int curToken = 0x102;
+    unsigned int endToken = 0x1FF;
+    size_t written = 0;
+
+    while (written < outLength && !bits.finished()) {
+        unsigned int token = bits.get_bits_lsb(numBits);
+        if (token == 0x101) break;
+        if (token == 0x100) {
+            numBits = 9;
+            curToken = 0x102;
+            endToken = 0x1FF;
+            continue;
+        }
+
+        size_t start = written;
+        if (token > 0xFF) {
+            if (token >= curToken) return false;
+            size_t len = tokenLength[token] + 1;
+            for (size_t i = 0; i < len && written < outLength; i++) out[written++] = out[tokenStart[token] + i];
+        }
+        else {
+            out[written++] = static_cast<unsigned char>(token);
+        }
+
+        if (curToken > endToken && numBits < 12) {
+            numBits++;
+            endToken = (endToken << 1) + 1;
+        }
+        if (curToken <= endToken) {
+            tokenStart[curToken] = static_cast<uint16_t>(start);
+            tokenLength[curToken] = static_cast<uint16_t>(written - start);
+            curToken++;
+        }
+    }
+    return written == outLength;
+}
+
+static bool unpack_huffman(const unsigned char* in, size_t inLength, unsigned char* out, size_t outLength) {
+    // A node count and the terminator code, then the tree as 2-byte nodes, then the bit stream. A node
+    // with a zero second byte is a leaf holding its value in the first byte. Otherwise its low and high
+    // nibbles are the distances (in nodes) to the children for a 1 and a 0 bit; a zero distance for a
+    // 1 bit means the next 8 bits are a literal.
+    if (inLength < 2) return false;
+    size_t numNodes = in[0];
+    unsigned int terminator = in[1] | 0x100;
+    const unsigned char* nodes = in + 2;
+    if (inLength < 2 + numNodes * 2) return false;
+
+    BitReader bits = { nodes + numNodes * 2, inLength - 2 - numNodes * 2, 0 };
+    size_t written = 0;
+    while (written < outLength && !bits.finished()) {
+        size_t node = 0;
+        unsigned int value = 0;
+        for (;;) {
+            if (node >= numNodes) return false;
+            unsigned char links = nodes[node * 2 + 1];
+            if (links == 0) {
+                value = nodes[node * 2];
+                break;
+            }
+            if (bits.get_bits_msb(1)) {
+                if ((links & 0x0F) == 0) {
+                    value = bits.get_bits_msb(8) | 0x100;
+                    break;
+                }
+                node += links & 0x0F;
+            }
+            else {
+                node += links >> 4;
+            }
+        }
+        if (value == terminator) break;
+        out[written++] = static_cast<unsigned char>(value);
+    }
+    return written == outLength;
+}
+
+bool unpack_resource(const char* data, size_t length, int type, int number, char* out, size_t outSize,
+                     size_t& outLength, string& error) {
+    if (length < 8 || read_le16(data) != ((type << 11) | number)) {
+        error = "resource header doesn't match RESOURCE.MAP";
+        return false;
+    }
+    size_t packedSize = read_le16(data + 2);
+    size_t unpackedSize = read_le16(data + 4);
+    int method = read_le16(data + 6);
+
+    if (packedSize < 4 || 8 + packedSize - 4 > length) {
+        error = "resource data is truncated";
+        return false;
+    }
+    if (unpackedSize > outSize) {
+        error = "resource is too large";
+        return false;
+    }
+    packedSize -= 4;
+
+    const unsigned char* in = reinterpret_cast<const unsigned char*>(data + 8);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out);
+    bool ok = false;
+    switch (method) {
+    case 0:
+        ok = (packedSize == unpackedSize);
+        if (ok) copy(in, in + unpackedSize, dst);
+        break;
+    case 1:
+        ok = unpack_lzw(in, packedSize, dst, unpackedSize);
+        break;
+    case 2:
+        ok = unpack_huffman(in, packedSize, dst, unpackedSize);
+        break;
+    default:
+        error = "unsupported compression method " + to_string(method);
+        return false;
+    }
+    if (!ok) {
+        error = "resource data is corrupt";
+        return false;
+    }
+    outLength = unpackedSize;
+    return true;
+}
+
+// Finds a file in "dir" regardless of case. DOS-era game files are usually uppercase, but copies made
+// on other systems often aren't.
+static bool find_game_file(const string& dir, const string& name, filesystem::path& found) {
+    error_code ec;
+    for (const auto& entry : filesystem::directory_iterator(dir, ec)) {
+        string entry_name = entry.path().filename().string();
+        if (entry_name.size() != name.size()) continue;
+        size_t i = 0;
+        while (i < name.size() && toupper(static_cast<unsigned char>(entry_name[i])) == toupper(static_cast<unsigned char>(name[i]))) i++;
+        if (i == name.size()) {
+            found = entry.path();
+            return true;
+        }
+    }
+    return false;
+}
+
+// The index is a short text file: a line identifying the RESOURCE.MAP it was built from (size and
+// modification time), then one "type number volume offset" line per patch resource in the map.
+static string map_stamp(const filesystem::path& map_path) {
+    error_code ec;
+    ostringstream stamp;
+    stamp << "SCI2FB-IDX 1 " << filesystem::file_size(map_path, ec) << " "
+          << filesystem::last_write_time(map_path, ec).time_since_epoch().count();
+    return stamp.str();
+}
+
+static bool read_index(const filesystem::path& index_path, const string& stamp, int type, int number,
+                       bool& found, ResourceLocation& location) {
+    ifstream index(index_path);
+    string line;
+    if (!getline(index, line) || line != stamp) return false;
+
+    found = false;
+    int entry_type, entry_number, volume;
+    uint32_t offset;
+    while (index >> entry_type >> entry_number >> volume >> offset) {
+        if (entry_type == type && entry_number == number) {
+            location.volume = volume;
+            location.offset = offset;
+            found = true;
+        }
+    }
+    return true;
+}
+
+static void write_index(const filesystem::path& index_path, const string& stamp, const char* map, size_t length) {
+    // Failing to write the index (a read-only game CD, say) only costs the next run a map parse
+    ofstream index(index_path, ios::trunc);
+    if (!index.good()) return;
+    index << stamp << "\n";
+    for (size_t pos = 0; pos + 6 <= length; pos += 6) {
+        uint16_t entry_id = read_le16(map + pos);
+        uint32_t entry_location = read_le32(map + pos + 2);
+        if (entry_id == 0xFFFF && entry_location == 0xFFFFFFFF) break;
+        if ((entry_id >> 11) != RESOURCE_TYPE_PATCH) continue;
+        index << (entry_id >> 11) << " " << (entry_id & 0x7FF) << " " << (entry_location >> 26) << " "
+              << (entry_location & 0x03FFFFFF) << "\n";
+    }
+}
+
+bool load_game_resource(const string& gamedir, int type, int number, char* out, size_t outSize,
+                        size_t& outLength, ResourceSource& source, string& error) {
+    // A stand-alone patch file overrides the volumes
+    filesystem::path patch_path;
+    char patch_name[16];
+    snprintf(patch_name, sizeof(patch_name), "PATCH.%03d", number);
+    if (type == RESOURCE_TYPE_PATCH && find_game_file(gamedir, patch_name, patch_path)) {
+        ifstream patch(patch_path, ios::binary);
+        patch.read(out, outSize);
+        outLength = static_cast<size_t>(patch.gcount());
+        source.file = patch_path.string();
+        source.inVolume = false;
+        return true;
+    }
+
+    filesystem::path map_path;
+    if (!find_game_file(gamedir, "RESOURCE.MAP", map_path)) {
+        error = "RESOURCE.MAP not found in " + gamedir;
+        return false;
+    }
+
+    // Use the cached index if it was built from this RESOURCE.MAP, otherwise parse the map and rebuild it
+    filesystem::path index_path = filesystem::path(gamedir) / INDEX_FILENAME;
+    string stamp = map_stamp(map_path);
+    ResourceLocation location = { 0, 0 };
+    bool found = false;
+    if (type != RESOURCE_TYPE_PATCH || !read_index(index_path, stamp, type, number, found, location)) {
+        ifstream map_file(map_path, ios::binary);
+        vector<char> map((istreambuf_iterator<char>(map_file)), istreambuf_iterator<char>());
+        found = find_resource(map.data(), map.size(), type, number, location);
+        write_index(index_path, stamp, map.data(), map.size());
+    }
+    if (!found) {
+        error = "resource " + to_string(number) + " of type " + to_string(type) + " is not in RESOURCE.MAP";
+        return false;
+    }
+
+    char volume_name[16];
+    snprintf(volume_name, sizeof(volume_name), "RESOURCE.%03d", location.volume);
+    filesystem::path volume_path;
+    if (!find_game_file(gamedir, volume_name, volume_path)) {
+        error = string(volume_name) + " not found in " + gamedir;
+        return false;
+    }
+
+    // Read the resource header, then exactly the packed data it describes
+    ifstream volume(volume_path, ios::binary);
+    char header[8];
+    volume.seekg(location.offset);
+    volume.read(header, sizeof(header));
+    if (volume.gcount() != sizeof(header)) {
+        error = "resource offset is past the end of " + string(volume_name);
+        return false;
+    }
+    size_t packedSize = read_le16(header + 2);
+    vector<char> data(sizeof(header) + (packedSize > 4 ? packedSize - 4 : 0));
+    copy(header, header + sizeof(header), data.begin());
+    volume.read(data.data() + sizeof(header), data.size() - sizeof(header));
+    data.resize(sizeof(header) + static_cast<size_t>(volume.gcount()));
+
+    source.file = volume_path.string();
+    source.inVolume = true;
+    source.offset = location.offset;
+    return unpack_resource(data.data(), data.size(), type, number, out, outSize, outLength, error);
+}
+
+bool load_archive_resource(const ZipArchive& archive, int type, int number, char* out, size_t outSize,
+                           size_t& outLength, ResourceSource& source, string& error) {
+    char patch_name[16];
+    snprintf(patch_name, sizeof(patch_name), "PATCH.%03d", number);
+    auto depth = [](const string& dir) { return dir.empty() ? 0 : 1 + count(dir.begin(), dir.end(), '/'); };
+    const ZipEntry* game = nullptr;
+    for (const ZipEntry& entry : archive.entries()) {
+        bool isGameFile = same_name(entry.name, "RESOURCE.MAP") || (type == RESOURCE_TYPE_PATCH && same_name(entry.name, patch_name));
+        if (isGameFile && (!game || depth(entry.dir) < depth(game->dir))) game = &entry;
+    }
+    if (!game) {
+        error = "no RESOURCE.MAP or " + string(patch_name) + " in the archive";
+        return false;
+    }
+
+    // A stand-alone patch file overrides the volumes
+    const ZipEntry* patch = (type == RESOURCE_TYPE_PATCH) ? archive.find(game->dir, patch_name) : nullptr;
+    auto entry_path = [](const ZipEntry& entry) { return entry.dir.empty() ? entry.name : entry.dir + "/" + entry.name; };
+    if (patch) {
+        source.file = entry_path(*patch);
+        source.inVolume = false;
+        return archive.extract(*patch, 0, out, outSize, outLength, error);
+    }
+
+    const ZipEntry* map_entry = archive.find(game->dir, "RESOURCE.MAP");
+    vector<char> map(map_entry->size);
+    size_t mapLength = 0;
+    if (!archive.extract(*map_entry, 0, map.data(), map.size(), mapLength, error)) return false;
+    ResourceLocation location = { 0, 0 };
+    if (!find_resource(map.data(), mapLength, type, number, location)) {
+        error = "resource " + to_string(number) + " of type " + to_string(type) + " is not in RESOURCE.MAP";
+        return false;
+    }
+
+    char volume_name[16];
+    snprintf(volume_name, sizeof(volume_name), "RESOURCE.%03d", location.volume);
+    const ZipEntry* volume = archive.find(game->dir, volume_name);
+    if (!volume) {
+        error = string(volume_name) + " not found in the archive";
+        return false;
+    }
+
+    // The packed size is only known once the header is out, but a resource can't be more than 64 KB packed,
+    // so inflating that much past the offset in one go gets all of it without inflating the volume twice
+    vector<char> data(8 + 0xFFFF);
+    size_t length = 0;
+    if (!archive.extract(*volume, location.offset, data.data(), data.size(), length, error)) return false;
+    if (length < 8) {
+        error = "resource offset is past the end of " + string(volume_name);
+        return false;
+    }
+    size_t packedSize = read_le16(data.data() + 2);
+    length = min(length, 8 + (packedSize > 4 ? packedSize - 4 : 0));
+    source.file = entry_path(*volume);
+    source.inVolume = true;
+    source.offset = location.offset;
+    return unpack_resource(data.data(), length, type, number, out, outSize, outLength, error);
+}
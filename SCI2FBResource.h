@@ -0,0 +1,58 @@
+/************************************************************************
+*   SCI2FB resource volume access                                       *
+*                                                                       *
+*   Finds resources through an SCI0 game's RESOURCE.MAP and unpacks     *
+*   them straight out of its RESOURCE.00x volume files, so patch        *
+*   resources can be converted without extracting them first.           *
+************************************************************************/
+
+#ifndef SCI2FB_RESOURCE_H
+#define SCI2FB_RESOURCE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+class ZipArchive;
+
+// SCI0 resource type of patch resources. Patch 2 (PATCH.002) holds the FB-01/IMFC banks.
+const int RESOURCE_TYPE_PATCH = 9;
+const int FB01_PATCH_NUMBER = 2;
+
+// Where a resource lives: the RESOURCE.00x volume number and the offset of its header inside that volume
+struct ResourceLocation {
+    int volume;
+    uint32_t offset;
+};
+
+// Where a loaded resource was read from. A stand-alone patch file keeps its patch file header; a resource out
+// of a volume doesn't have one.
+struct ResourceSource {
+    std::string file;           // The patch file or RESOURCE.00x volume (its path inside the archive for a ZIP)
+    bool inVolume = false;
+    uint32_t offset = 0;        // Offset of the resource's header in the volume
+};
+
+// Looks up resource (type, number) in a RESOURCE.MAP image
+bool find_resource(const char* map, size_t length, int type, int number, ResourceLocation& location);
+
+// Unpacks the resource whose volume header starts at "data" into "out" (no more than outSize bytes).
+// Handles uncompressed, LZW and Huffman packed SCI0 resources. Returns false with "error" set when the
+// header doesn't describe resource (type, number) or the data can't be unpacked.
+bool unpack_resource(const char* data, size_t length, int type, int number, char* out, size_t outSize,
+                     size_t& outLength, std::string& error);
+
+// Loads resource (type, number) from the game installed in "gamedir". A stand-alone patch file such as
+// PATCH.002 takes priority, as it does in the interpreter. Otherwise the map offsets are taken from the
+// SCI2FB.IDX index in the game directory, which is (re)built from RESOURCE.MAP whenever it is missing or
+// older than the map. "source" says which of the two it came from.
+bool load_game_resource(const std::string& gamedir, int type, int number, char* out, size_t outSize,
+                        size_t& outLength, ResourceSource& source, std::string& error);
+
+// The same, for a game packed in a ZIP archive, which is read in place. The game is the shallowest
+// directory in the archive holding RESOURCE.MAP or the patch file, so archives of a game's whole folder work
+// as well as ones of its files. No index is kept; the map is small enough to search each time.
+bool load_archive_resource(const ZipArchive& archive, int type, int number, char* out, size_t outSize,
+                           size_t& outLength, ResourceSource& source, std::string& error);
+
+#endif
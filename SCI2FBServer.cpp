@@ -0,0 +1,267 @@
+/************************************************************************
+*   SCI2FB conversion server                                            *
+*                                                                       *
+*   See SCI2FBServer.h                                                  *
+************************************************************************/
+
+#include "SCI2FBServer.h"
+#include "SCI2FBCore.h"
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+static void close_socket(socket_t s) { closesocket(s); }
+const int MSG_NOSIGNAL_FLAG = 0;
+#else
+#include <netdb.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+typedef int socket_t;
+const socket_t INVALID_SOCKET = -1;
+// A client hanging up mid-response must not kill the server with SIGPIPE
+#ifdef MSG_NOSIGNAL
+const int MSG_NOSIGNAL_FLAG = MSG_NOSIGNAL;
+#else
+const int MSG_NOSIGNAL_FLAG = 0;
+#endif
+static void close_socket(socket_t s) { close(s); }
+#endif
+
+using namespace std;
+
+// A connection that sends nothing for this long is closed, so idle clients can't hold on to every worker.
+// The same limit applies to a response the client isn't reading.
+const int IDLE_TIMEOUT_SECONDS = 30;
+
+static void set_timeouts(socket_t s) {
+#ifdef _WIN32
+    DWORD timeout = IDLE_TIMEOUT_SECONDS * 1000;
+#else
+    timeval timeout = {};
+    timeout.tv_sec = IDLE_TIMEOUT_SECONDS;
+#endif
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, reinterpret_cast<const char*>(&timeout), sizeof(timeout));
+}
+
+static bool recv_all(socket_t s, char* data, size_t length) {
+    while (length > 0) {
+        int n = recv(s, data, static_cast<int>(length), 0);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static bool send_all(socket_t s, const char* data, size_t length) {
+    while (length > 0) {
+        int n = send(s, data, static_cast<int>(length), MSG_NOSIGNAL_FLAG);
+        if (n <= 0) return false;
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static uint32_t read_u32(const unsigned char* bytes) {
+    return bytes[0] | (bytes[1] << 8) | (bytes[2] << 16) | (static_cast<uint32_t>(bytes[3]) << 24);
+}
+
+static void serve_connection(socket_t s, bool allowRaw) {
+    // The buffers are sized for the largest valid request and response, so nothing is allocated per request
+    char image[MAX_PATCH_SIZE];
+    char response[6 + 2 * BANK_SYSEX_SIZE];
+    SysexBank bankA;
+    SysexBank bankB;
+
+    for (;;) {
+        unsigned char header[5];
+        if (!recv_all(s, reinterpret_cast<char*>(header), sizeof(header))) break;
+        uint32_t length = read_u32(header);
+        char label[256 + 6];
+        if (!recv_all(s, label, header[4])) break;
+        label[header[4]] = '\0';
+        if (header[4] == 0) strcpy(label, "patch");
+
+        // An oversized patch is drained and rejected without being stored, the same as a file that's too big
+        PatchError error = PatchError::None;
+        int nBanks = 0;
+        if (length > sizeof(image)) {
+            error = PatchError::InvalidSize;
+            char discard[4096];
+            for (uint32_t left = length; left > 0;) {
+                uint32_t n = (left < sizeof(discard)) ? left : static_cast<uint32_t>(sizeof(discard));
+                if (!recv_all(s, discard, n)) {
+                    close_socket(s);
+                    return;
+                }
+                left -= n;
+            }
+        }
+        else {
+            if (!recv_all(s, image, length)) break;
+
+            // Name the banks the way convert_patch_image names its output files, since that's what the
+            // labels are made from
+            if (char* ext_pos = strrchr(label, '.')) *ext_pos = '\0';
+            char labelA[sizeof(label)];
+            char labelB[sizeof(label)];
+            strcpy(labelA, label);
+            strcpy(labelB, label);
+            PatchLayout layout;
+            error = find_patch_layout(image, length, layout, allowRaw);
+            nBanks = layout.nBanks;
+            strcat(labelA, (nBanks == 2) ? "_a.syx" : ".syx");
+            strcat(labelB, "_b.syx");
+            if (error == PatchError::None) convert_patch(image, layout, labelA, bankA, bankB, labelB);
+        }
+
+        size_t dataLength = 0;
+        if (error == PatchError::None) {
+            memcpy(response + 6, bankA.data(), bankA.size());
+            if (nBanks == 2) memcpy(response + 6 + bankA.size(), bankB.data(), bankB.size());
+            dataLength = bankA.size() * nBanks;
+        }
+        else {
+            const char* message = patch_error_message(error);
+            dataLength = strlen(message);
+            memcpy(response + 6, message, dataLength);
+            nBanks = 0;
+        }
+        response[0] = static_cast<char>(error);
+        response[1] = static_cast<char>(nBanks);
+        for (int i = 0; i < 4; i++) response[2 + i] = static_cast<char>((dataLength >> (i * 8)) & 0xFF);
+        if (!send_all(s, response, 6 + dataLength)) break;
+    }
+    close_socket(s);
+}
+
+static socket_t listen_on(const string& address, string& error) {
+    socket_t s = INVALID_SOCKET;
+#ifndef _WIN32
+    if (address.compare(0, 5, "unix:") == 0) {
+        sockaddr_un addr = {};
+        addr.sun_family = AF_UNIX;
+        string path = address.substr(5);
+        if (path.size() >= sizeof(addr.sun_path)) {
+            error = "socket path " + path + " is too long";
+            return INVALID_SOCKET;
+        }
+        strcpy(addr.sun_path, path.c_str());
+        // A socket file left behind by an earlier server would make bind fail, so one is removed. Anything else
+        // at the path is left alone.
+        struct stat existing;
+        if (lstat(path.c_str(), &existing) == 0) {
+            if (!S_ISSOCK(existing.st_mode)) {
+                error = "could not listen on " + address + ": address in use";
+                return INVALID_SOCKET;
+            }
+            unlink(path.c_str());
+        }
+        s = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (s == INVALID_SOCKET || bind(s, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0 || listen(s, SOMAXCONN) != 0) {
+            if (s != INVALID_SOCKET) close_socket(s);
+            error = "could not listen on " + address;
+            return INVALID_SOCKET;
+        }
+        return s;
+    }
+#endif
+
+    // "host:port" or a bare port, which stays on localhost
+    size_t colon = address.rfind(':');
+    string host = (colon == string::npos) ? "127.0.0.1" : address.substr(0, colon);
+    string port = (colon == string::npos) ? address : address.substr(colon + 1);
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* result = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) {
+        error = "could not resolve " + address;
+        return INVALID_SOCKET;
+    }
+    for (addrinfo* ai = result; ai && s == INVALID_SOCKET; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == INVALID_SOCKET) continue;
+        int on = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, reinterpret_cast<const char*>(&on), sizeof(on));
+        if (bind(s, ai->ai_addr, static_cast<int>(ai->ai_addrlen)) != 0 || listen(s, SOMAXCONN) != 0) {
+            close_socket(s);
+            s = INVALID_SOCKET;
+        }
+    }
+    freeaddrinfo(result);
+    if (s == INVALID_SOCKET) error = "could not listen on " + address;
+    return s;
+}
+
+ConversionServer::~ConversionServer() {
+    if (listener != INVALID_SOCKET) close_socket(listener);
+}
+
+bool ConversionServer::open(const string& address, string& error) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) {
+        error = "could not start Winsock";
+        return false;
+    }
+#endif
+    listener = listen_on(address, error);
+    return listener != INVALID_SOCKET;
+}
+
+void ConversionServer::run(unsigned nThreads, bool allowRaw) {
+    // Accepted connections queue up for the workers, each of which serves one connection at a time, until the
+    // client hangs up or goes idle
+    mutex queue_mutex;
+    condition_variable queue_ready;
+    deque<socket_t> connections;
+    auto worker = [&]() {
+        for (;;) {
+            unique_lock<mutex> lock(queue_mutex);
+            queue_ready.wait(lock, [&]() { return !connections.empty(); });
+            socket_t s = connections.front();
+            connections.pop_front();
+            lock.unlock();
+            serve_connection(s, allowRaw);
+        }
+    };
+    if (nThreads == 0) nThreads = 1;
+    vector<thread> pool;
+    for (unsigned t = 0; t < nThreads; t++) pool.emplace_back(worker);
+
+    for (;;) {
+        socket_t s = accept(listener, nullptr, nullptr);
+        if (s == INVALID_SOCKET) {
+            // Out of descriptors (or any other failure that would just repeat at once): the pending connection
+            // stays queued, so wait for the workers to close some before trying again
+            this_thread::sleep_for(chrono::milliseconds(100));
+            continue;
+        }
+        set_timeouts(s);
+        // Responses are written in one piece, so there's nothing for Nagle's algorithm to gather
+        int on = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&on), sizeof(on));
+        lock_guard<mutex> lock(queue_mutex);
+        connections.push_back(s);
+        queue_ready.notify_one();
+    }
+}
@@ -0,0 +1,47 @@
+/************************************************************************
+*   SCI2FB conversion server                                            *
+*                                                                       *
+*   Long-running server mode: converts patch resources sent over a     *
+*   Unix domain socket or TCP connection entirely in memory, so a       *
+*   front end doesn't pay for a process start per conversion.           *
+************************************************************************/
+
+#ifndef SCI2FB_SERVER_H
+#define SCI2FB_SERVER_H
+
+#include <cstdint>
+#include <string>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  Each connection carries any number of requests, answered in order:                 //
+//                                                                                      //
+//  Request:    u32 patch length, u8 label length, label, patch resource bytes          //
+//  Response:   u8 status, u8 bank count, u32 data length, data                         //
+//                                                                                      //
+//  Integers are little endian. The label names the banks the way an output_bank name   //
+//  does on the command line ("patch" when empty). A status of 0 means success, and the //
+//  data is then the sysex bank dump(s) back to back. Any other status is a PatchError  //
+//  value, and the data is its message.                                                 //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class ConversionServer {
+public:
+    ~ConversionServer();
+
+    // Listens on "address": "unix:/path/to/socket", "host:port" or just a TCP port number (bound to
+    // localhost). Returns false with "error" set on failure.
+    bool open(const std::string& address, std::string& error);
+
+    // Accepts connections for good, each served by one of a pool of nThreads workers until the client hangs
+    // up or sends nothing for 30 seconds. "allowRaw" also takes headerless voice dumps, as --raw does.
+    void run(unsigned nThreads, bool allowRaw = false);
+
+private:
+#ifdef _WIN32
+    uintptr_t listener = ~static_cast<uintptr_t>(0);
+#else
+    int listener = -1;
+#endif
+};
+
+#endif
@@ -0,0 +1,88 @@
+/************************************************************************
+*   SCI2FB conversion statistics                                        *
+*                                                                       *
+*   See SCI2FBStats.h                                                   *
+************************************************************************/
+
+#include "SCI2FBStats.h"
+#include "SCI2FBCore.h"
+
+#include <algorithm>
+#include <iomanip>
+
+using namespace std;
+
+static const char* stage_names[STAGE_COUNT] = { "read", "validate", "cache", "extract", "nibblize", "header", "write" };
+
+static double to_ms(uint64_t ns) {
+    return ns / 1e6;
+}
+
+void Stats::enable() {
+    on = true;
+    started = Clock::now();
+}
+
+Stats::Clock::time_point Stats::lap(Stage stage, Clock::time_point start) {
+    if (!on) return start;
+    Clock::time_point t = Clock::now();
+    stageNs[stage] += chrono::duration_cast<chrono::nanoseconds>(t - start).count();
+    return t;
+}
+
+void Stats::add_io(int calls, uint64_t nRead, uint64_t nWritten) {
+    if (!on) return;
+    ioCalls += calls;
+    bytesRead += nRead;
+    bytesWritten += nWritten;
+}
+
+void Stats::add_file(bool converted, int banks, Clock::time_point start) {
+    if (!on) return;
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - start).count();
+    nFiles++;
+    if (converted) nBanks += banks;
+    else nFailed++;
+
+    lock_guard<mutex> lock(latency_mutex);
+    latencies.push_back(ns);
+}
+
+uint64_t Stats::percentile(int p) {
+    // Nearest rank, so p99 of a small batch is its slowest file rather than an interpolated value
+    lock_guard<mutex> lock(latency_mutex);
+    if (latencies.empty()) return 0;
+    sort(latencies.begin(), latencies.end());
+    size_t rank = (latencies.size() * p + 99) / 100;
+    return latencies[max<size_t>(rank, 1) - 1];
+}
+
+void Stats::print(ostream& out) {
+    uint64_t wallNs = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - started).count();
+    out << fixed << setprecision(3);
+    out << "---------------------------------" << endl;
+    out << nFiles << " files (" << nFailed << " failed), " << nBanks << " banks, "
+        << nBanks * VOICES_PER_BANK << " voices" << endl;
+    out << bytesRead << " bytes read, " << bytesWritten << " bytes written, " << ioCalls << " I/O calls";
+    if (ioBackend) out << " (" << ioBackend << " reads)";
+    out << endl;
+    for (int s = 0; s < STAGE_COUNT; s++) {
+        out << "  " << left << setw(10) << stage_names[s] << right << setw(12) << to_ms(stageNs[s]) << " ms" << endl;
+    }
+    out << "  " << left << setw(10) << "total" << right << setw(12) << to_ms(wallNs) << " ms" << endl;
+    out << "Latency per file: p50 " << to_ms(percentile(50)) << " ms, p99 " << to_ms(percentile(99)) << " ms" << endl;
+}
+
+void Stats::print_json(ostream& out) {
+    // One line, so it can be picked out of the console output with tail -1
+    uint64_t wallNs = chrono::duration_cast<chrono::nanoseconds>(Clock::now() - started).count();
+    out << fixed << setprecision(3);
+    out << "{\"files\":" << nFiles << ",\"failed\":" << nFailed << ",\"banks\":" << nBanks
+        << ",\"voices\":" << nBanks * VOICES_PER_BANK << ",\"bytes_read\":" << bytesRead
+        << ",\"bytes_written\":" << bytesWritten << ",\"io_calls\":" << ioCalls;
+    if (ioBackend) out << ",\"io_backend\":\"" << ioBackend << '"';
+    out << ",\"stage_ms\":{";
+    for (int s = 0; s < STAGE_COUNT; s++) out << (s ? "," : "") << '"' << stage_names[s] << "\":" << to_ms(stageNs[s]);
+    out << "},\"wall_ms\":" << to_ms(wallNs) << ",\"latency_ms\":{\"p50\":" << to_ms(percentile(50))
+        << ",\"p99\":" << to_ms(percentile(99)) << "}}" << endl;
+}
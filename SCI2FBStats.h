@@ -0,0 +1,73 @@
+/************************************************************************
+*   SCI2FB conversion statistics                                        *
+*                                                                       *
+*   Per-stage wall time and I/O counters for the --stats and            *
+*   --stats-json options, so a slow run can be pinned on storage or     *
+*   on the conversion itself.                                           *
+************************************************************************/
+
+#ifndef SCI2FB_STATS_H
+#define SCI2FB_STATS_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+#include <ostream>
+#include <vector>
+
+// The timed stages of a conversion, in the order they run
+enum Stage {
+    STAGE_READ,             // Reading the patch file into memory
+    STAGE_VALIDATE,         // check_patch
+    STAGE_CACHE,            // Conversion cache lookups and stores
+    STAGE_EXTRACT,          // Copying the voices out of the patch image
+    STAGE_NIBBLIZE,         // Building the voice packets
+    STAGE_HEADER,           // Building the bank headers
+    STAGE_WRITE,            // Writing the sysex banks
+    STAGE_COUNT
+};
+
+class Stats {
+public:
+    typedef std::chrono::steady_clock Clock;
+
+    // Nothing is measured until enabled, so the timing calls cost next to nothing without --stats
+    void enable();
+    bool enabled() const { return on; }
+
+    Clock::time_point now() const { return on ? Clock::now() : Clock::time_point(); }
+
+    // Adds the time since "start" to "stage" and returns the current time, so stages can be timed back to back
+    Clock::time_point lap(Stage stage, Clock::time_point start);
+
+    // Counts the I/O calls (opens, reads, writes and closes) the tool itself issued and the bytes they moved
+    void add_io(int calls, uint64_t nRead, uint64_t nWritten);
+
+    // Records one patch conversion: whether it succeeded, the banks it produced and its latency since "start"
+    void add_file(bool converted, int nBanks, Clock::time_point start);
+
+    // Names the way the input files were read (AsyncReader::backend), for runs that read through one
+    void set_io_backend(const char* backend) { ioBackend = backend; }
+
+    void print(std::ostream& out);
+    void print_json(std::ostream& out);
+
+private:
+    bool on = false;
+    Clock::time_point started;
+    std::atomic<uint64_t> stageNs[STAGE_COUNT] = {};
+    std::atomic<uint64_t> ioCalls{0};
+    std::atomic<uint64_t> bytesRead{0};
+    std::atomic<uint64_t> bytesWritten{0};
+    std::atomic<uint64_t> nFiles{0};
+    std::atomic<uint64_t> nFailed{0};
+    std::atomic<uint64_t> nBanks{0};
+    const char* ioBackend = nullptr;
+    std::mutex latency_mutex;
+    std::vector<uint64_t> latencies;    // Per file, in nanoseconds
+
+    uint64_t percentile(int p);
+};
+
+#endif
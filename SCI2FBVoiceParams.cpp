@@ -0,0 +1,169 @@
+/************************************************************************
+*   SCI2FB voice parameters                                             *
+*                                                                       *
+*   See SCI2FBVoiceParams.h                                             *
+************************************************************************/
+
+#include "SCI2FBVoiceParams.h"
+
+#include <algorithm>
+
+// SIMD distance kernels are used where the target guarantees them. Define SCI2FB_NO_SIMD to force the
+// scalar path.
+#if !defined(SCI2FB_NO_SIMD)
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define SCI2FB_SSE2
+#elif defined(__ARM_NEON) || defined(_M_ARM64)
+#include <arm_neon.h>
+#define SCI2FB_NEON
+#endif
+#endif
+
+using namespace std;
+
+// Where a parameter lives in the voice data: byte offset, shift and mask of its bits. Operator offsets are
+// relative to the operator's 8 bytes, which start at 10h for the first operator.
+struct ParamField {
+    unsigned char offset;
+    unsigned char shift;
+    unsigned char mask;
+};
+
+static const ParamField voice_fields[PARAM_VOICE_COUNT] = {
+    { 0x0C, 0, 0x07 },          // Algorithm
+    { 0x0C, 3, 0x07 },          // Feedback
+    { 0x0E, 5, 0x03 },          // LFO waveform
+    { 0x08, 0, 0xFF },          // LFO speed
+    { 0x09, 0, 0x7F },          // AMD (bit 7 is the LFO load flag)
+    { 0x0A, 0, 0x7F },          // PMD (bit 7 is the LFO sync flag)
+    { 0x0D, 0, 0x03 },          // AMS
+    { 0x0D, 4, 0x07 },          // PMS
+    { 0x0F, 0, 0xFF },          // Transpose
+};
+
+static const ParamField operator_fields[OP_PARAM_COUNT] = {
+    { 0, 0, 0x7F },             // Total level
+    { 1, 4, 0x07 },             // Velocity sensitivity
+    { 2, 4, 0x0F },             // Level scaling depth
+    { 3, 0, 0x0F },             // Multiple
+    { 3, 4, 0x07 },             // Detune 1
+    { 4, 6, 0x03 },             // Rate scaling
+    { 4, 0, 0x1F },             // Attack rate
+    { 5, 0, 0x1F },             // Decay 1 rate
+    { 6, 6, 0x03 },             // Detune 2
+    { 6, 0, 0x1F },             // Decay 2 rate
+    { 7, 4, 0x0F },             // Sustain level
+    { 7, 0, 0x0F },             // Release rate
+};
+
+const int OPERATOR_DATA_OFFSET = 0x10;
+const int OPERATOR_DATA_SIZE = 8;
+
+// Each parameter's weight in the distance: 255 divided by its largest value, so every parameter spans about
+// the same range. The largest possible distance, PARAM_COUNT * 255, still fits 16 bits.
+struct ParamWeights {
+    unsigned char weight[PARAM_COUNT];
+
+    constexpr ParamWeights() : weight() {
+        for (int p = 0; p < PARAM_VOICE_COUNT; p++) weight[p] = 255 / voice_fields[p].mask;
+        for (int op = 0; op < OPERATORS_PER_VOICE; op++) {
+            for (int p = 0; p < OP_PARAM_COUNT; p++) weight[PARAM_VOICE_COUNT + op * OP_PARAM_COUNT + p] = 255 / operator_fields[p].mask;
+        }
+    }
+};
+
+static constexpr ParamWeights param_weights;
+
+void decode_voice(const char* voice, unsigned char params[PARAM_COUNT]) {
+    const unsigned char* bytes = reinterpret_cast<const unsigned char*>(voice);
+    for (int p = 0; p < PARAM_VOICE_COUNT; p++) {
+        const ParamField& field = voice_fields[p];
+        params[p] = (bytes[field.offset] >> field.shift) & field.mask;
+    }
+    params[PARAM_TRANSPOSE] ^= 0x80;
+
+    for (int op = 0; op < OPERATORS_PER_VOICE; op++) {
+        const unsigned char* data = bytes + OPERATOR_DATA_OFFSET + op * OPERATOR_DATA_SIZE;
+        for (int p = 0; p < OP_PARAM_COUNT; p++) {
+            const ParamField& field = operator_fields[p];
+            params[operator_param(op, static_cast<OperatorParam>(p))] = (data[field.offset] >> field.shift) & field.mask;
+        }
+    }
+}
+
+void VoiceParamStore::reserve(size_t count) {
+    for (vector<unsigned char>& column : columns) column.reserve(count);
+}
+
+void VoiceParamStore::add(const char* voice) {
+    unsigned char params[PARAM_COUNT];
+    decode_voice(voice, params);
+    for (int p = 0; p < PARAM_COUNT; p++) columns[p].push_back(params[p]);
+    nVoices++;
+}
+
+static void add_distances(const unsigned char* column, size_t count, unsigned char query, unsigned char weight, uint16_t* distances) {
+    // distances[i] += |column[i] - query| * weight for "count" voices
+    size_t i = 0;
+
+#if defined(SCI2FB_SSE2)
+    // SSE2 has no unsigned absolute difference, but one of the two saturating subtractions is always 0.
+    // The differences are widened to 16 bits to be weighted and added.
+    const __m128i q = _mm_set1_epi8(static_cast<char>(query));
+    const __m128i w = _mm_set1_epi16(weight);
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= count; i += 16) {
+        __m128i values = _mm_loadu_si128(reinterpret_cast<const __m128i*>(column + i));
+        __m128i diff = _mm_or_si128(_mm_subs_epu8(values, q), _mm_subs_epu8(q, values));
+        __m128i* out = reinterpret_cast<__m128i*>(distances + i);
+        _mm_storeu_si128(out, _mm_add_epi16(_mm_loadu_si128(out), _mm_mullo_epi16(_mm_unpacklo_epi8(diff, zero), w)));
+        _mm_storeu_si128(out + 1, _mm_add_epi16(_mm_loadu_si128(out + 1), _mm_mullo_epi16(_mm_unpackhi_epi8(diff, zero), w)));
+    }
+#elif defined(SCI2FB_NEON)
+    // vabd gives the absolute differences and vmlal widens, weights and adds them in one go
+    const uint8x16_t q = vdupq_n_u8(query);
+    const uint8x8_t w = vdup_n_u8(weight);
+    for (; i + 16 <= count; i += 16) {
+        uint8x16_t diff = vabdq_u8(vld1q_u8(column + i), q);
+        vst1q_u16(distances + i, vmlal_u8(vld1q_u16(distances + i), vget_low_u8(diff), w));
+        vst1q_u16(distances + i + 8, vmlal_u8(vld1q_u16(distances + i + 8), vget_high_u8(diff), w));
+    }
+#endif
+
+    for (; i < count; i++) {
+        int diff = static_cast<int>(column[i]) - query;
+        distances[i] = static_cast<uint16_t>(distances[i] + ((diff < 0) ? -diff : diff) * weight);
+    }
+}
+
+void VoiceParamStore::nearest(size_t query, size_t count, vector<VoiceMatch>& matches) const {
+    matches.clear();
+    if (query >= nVoices || count == 0) return;
+    unsigned char q[PARAM_COUNT];
+    for (int p = 0; p < PARAM_COUNT; p++) q[p] = columns[p][query];
+
+    // The voices are scanned a block at a time, small enough that the block's distances stay in L1 cache
+    // while every column of the block is added in. The best "count" so far are kept as a max-heap on
+    // distance, so most voices are turned away with one comparison against its top.
+    const size_t BLOCK_SIZE = 2048;
+    uint16_t distances[BLOCK_SIZE];
+    auto farther = [](const VoiceMatch& a, const VoiceMatch& b) { return a.distance < b.distance; };
+    for (size_t start = 0; start < nVoices; start += BLOCK_SIZE) {
+        size_t n = min(BLOCK_SIZE, nVoices - start);
+        fill(distances, distances + n, static_cast<uint16_t>(0));
+        for (int p = 0; p < PARAM_COUNT; p++) add_distances(columns[p].data() + start, n, q[p], param_weights.weight[p], distances);
+
+        for (size_t i = 0; i < n; i++) {
+            if (start + i == query) continue;
+            if (matches.size() == count) {
+                if (distances[i] >= matches.front().distance) continue;
+                pop_heap(matches.begin(), matches.end(), farther);
+                matches.pop_back();
+            }
+            matches.push_back({ start + i, distances[i] });
+            push_heap(matches.begin(), matches.end(), farther);
+        }
+    }
+    sort_heap(matches.begin(), matches.end(), farther);
+}
@@ -0,0 +1,90 @@
+/************************************************************************
+*   SCI2FB voice parameters                                             *
+*                                                                       *
+*   Decodes raw 64-byte FB-01 voices into their synthesis parameters,   *
+*   kept column by column across a whole corpus of voices so they can   *
+*   be searched for the voices that sound most alike.                   *
+************************************************************************/
+
+#ifndef SCI2FB_VOICE_PARAMS_H
+#define SCI2FB_VOICE_PARAMS_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Parameters that apply to the whole voice
+enum VoiceParam {
+    PARAM_ALGORITHM,
+    PARAM_FEEDBACK,
+    PARAM_LFO_WAVE,
+    PARAM_LFO_SPEED,
+    PARAM_AMD,                  // Amplitude modulation depth
+    PARAM_PMD,                  // Pitch modulation depth
+    PARAM_AMS,                  // Amplitude modulation sensitivity
+    PARAM_PMS,                  // Pitch modulation sensitivity
+    PARAM_TRANSPOSE,            // Stored offset by 128 so it orders like the signed value
+    PARAM_VOICE_COUNT
+};
+
+// Parameters each of the 4 operators has, which follow the voice parameters operator by operator
+enum OperatorParam {
+    OP_LEVEL,                   // Total level (attenuation, 0 is loudest)
+    OP_VELOCITY,                // Velocity sensitivity
+    OP_LEVEL_SCALING,
+    OP_MULTIPLE,
+    OP_DETUNE1,
+    OP_RATE_SCALING,
+    OP_ATTACK,
+    OP_DECAY1,
+    OP_DETUNE2,                 // Inharmonic detune
+    OP_DECAY2,
+    OP_SUSTAIN,
+    OP_RELEASE,
+    OP_PARAM_COUNT
+};
+
+const int OPERATORS_PER_VOICE = 4;
+const int PARAM_COUNT = PARAM_VOICE_COUNT + OPERATORS_PER_VOICE * OP_PARAM_COUNT;
+
+// Index of an operator parameter, for operator 0-3 in the order they sit in the voice data
+inline int operator_param(int op, OperatorParam param) { return PARAM_VOICE_COUNT + op * OP_PARAM_COUNT + param; }
+
+// Unpacks the parameters of one 64-byte voice
+void decode_voice(const char* voice, unsigned char params[PARAM_COUNT]);
+
+struct VoiceMatch {
+    size_t voice;               // Position of the voice in the store
+    unsigned distance;
+};
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  The store keeps one contiguous column per parameter, holding that parameter for     //
+//  every voice, rather than one record per voice. A search only ever compares one      //
+//  parameter across many voices at a time, so it streams through the columns 16       //
+//  voices per SIMD instruction.                                                        //
+//                                                                                      //
+//  The distance between two voices is the sum of their differences in every parameter, //
+//  each scaled to a 0-255 range first so a 3-bit parameter such as the algorithm       //
+//  weighs as much as a 7-bit one such as an operator's level.                          //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+class VoiceParamStore {
+public:
+    void reserve(size_t nVoices);
+    void add(const char* voice);
+    size_t size() const { return nVoices; }
+
+    unsigned char param(size_t voice, int param) const { return columns[param][voice]; }
+    const unsigned char* column(int param) const { return columns[param].data(); }
+
+    // Fills "matches" with the "count" voices nearest to "query", nearest first. The query voice itself is
+    // left out.
+    void nearest(size_t query, size_t count, std::vector<VoiceMatch>& matches) const;
+
+private:
+    std::vector<unsigned char> columns[PARAM_COUNT];
+    size_t nVoices = 0;
+};
+
+#endif
@@ -0,0 +1,127 @@
+/************************************************************************
+*   SCI2FB voice store                                                  *
+*                                                                       *
+*   See SCI2FBVoiceStore.h                                              *
+************************************************************************/
+
+#include "SCI2FBVoiceStore.h"
+
+#include <cstdio>
+#include <filesystem>
+#include <sstream>
+
+using namespace std;
+
+VoiceHash hash_voice(const char* voice) {
+    // 64-bit FNV-1a over the raw voice bytes
+    VoiceHash hash = 0xCBF29CE484222325ULL;
+    for (int i = 0; i < VOICE_SIZE; i++) {
+        hash ^= static_cast<unsigned char>(voice[i]);
+        hash *= 0x100000001B3ULL;
+    }
+    return hash;
+}
+
+static string hash_to_hex(VoiceHash hash) {
+    char hex[17];
+    snprintf(hex, sizeof(hex), "%016llx", static_cast<unsigned long long>(hash));
+    return hex;
+}
+
+static void write_hash(ofstream& file, VoiceHash hash) {
+    // Stored little endian so the index reads the same on every platform
+    char bytes[8];
+    for (int i = 0; i < 8; i++) bytes[i] = static_cast<char>(hash >> (i * 8));
+    file.write(bytes, sizeof(bytes));
+}
+
+bool VoiceStore::open(const string& store_dir, string& error) {
+    dir = store_dir;
+    error_code ec;
+    filesystem::create_directories(dir, ec);
+
+    filesystem::path voices_path = filesystem::path(dir) / "VOICES.BIN";
+    filesystem::path index_path = filesystem::path(dir) / "VOICES.IDX";
+    filesystem::path banks_path = filesystem::path(dir) / "BANKS.TXT";
+
+    // Load the hash index in one read
+    ifstream index_in(index_path, ios::binary);
+    vector<char> raw_index((istreambuf_iterator<char>(index_in)), istreambuf_iterator<char>());
+    index_in.close();
+    for (size_t pos = 0; pos + 8 <= raw_index.size(); pos += 8) {
+        VoiceHash hash = 0;
+        for (int i = 0; i < 8; i++) hash |= static_cast<VoiceHash>(static_cast<unsigned char>(raw_index[pos + i])) << (i * 8);
+        hashes.push_back(hash);
+    }
+
+    // If the index doesn't cover VOICES.BIN exactly (an interrupted run, or a deleted index), rebuild it
+    // from the voices themselves
+    uintmax_t voices_size = filesystem::exists(voices_path, ec) ? filesystem::file_size(voices_path, ec) : 0;
+    bool rebuild = (voices_size != hashes.size() * VOICE_SIZE);
+    if (rebuild) {
+        hashes.clear();
+        ifstream voices_in(voices_path, ios::binary);
+        char voice[VOICE_SIZE];
+        while (voices_in.read(voice, sizeof(voice))) hashes.push_back(hash_voice(voice));
+        voices_in.close();
+        // Drop any partial voice left at the end
+        if (voices_size != hashes.size() * VOICE_SIZE) filesystem::resize_file(voices_path, hashes.size() * VOICE_SIZE, ec);
+    }
+    for (size_t i = 0; i < hashes.size(); i++) index.emplace(hashes[i], static_cast<uint32_t>(i));
+
+    voices_file.open(voices_path, ios::binary | ios::app);
+    index_file.open(index_path, ios::binary | (rebuild ? ios::trunc : ios::app));
+    banks_file.open(banks_path, ios::app);
+    if (!voices_file.good() || !index_file.good() || !banks_file.good()) {
+        error = "could not open voice store " + dir;
+        return false;
+    }
+    if (rebuild) {
+        for (VoiceHash hash : hashes) write_hash(index_file, hash);
+        index_file.flush();
+    }
+    return true;
+}
+
+bool VoiceStore::add_bank(const RawBank& data, const string& source, int bank) {
+    VoiceHash bank_hashes[VOICES_PER_BANK];
+    for (int i = 0; i < VOICES_PER_BANK; i++) bank_hashes[i] = hash_voice(data.data() + i * VOICE_SIZE);
+
+    ostringstream line;
+    line << source << '\t' << static_cast<char>('A' + bank) << '\t';
+    for (int i = 0; i < VOICES_PER_BANK; i++) line << (i ? " " : "") << hash_to_hex(bank_hashes[i]);
+
+    lock_guard<mutex> lock(store_mutex);
+    for (int i = 0; i < VOICES_PER_BANK; i++) {
+        nAdded++;
+        if (index.count(bank_hashes[i])) continue;
+        index.emplace(bank_hashes[i], static_cast<uint32_t>(hashes.size()));
+        hashes.push_back(bank_hashes[i]);
+        nNew++;
+        voices_file.write(data.data() + i * VOICE_SIZE, VOICE_SIZE);
+        write_hash(index_file, bank_hashes[i]);
+    }
+    banks_file << line.str() << '\n';
+
+    // Voices go out before the index entries that point at them
+    voices_file.flush();
+    index_file.flush();
+    banks_file.flush();
+    return voices_file.good() && index_file.good() && banks_file.good();
+}
+
+bool VoiceStore::find_voice_users(const string& store_dir, VoiceHash hash, vector<string>& users, string& error) {
+    ifstream banks_in(filesystem::path(store_dir) / "BANKS.TXT");
+    if (!banks_in.good()) {
+        error = "no voice store in " + store_dir;
+        return false;
+    }
+    string hex = hash_to_hex(hash);
+    string line;
+    while (getline(banks_in, line)) {
+        size_t source_end = line.find('\t');
+        if (source_end == string::npos || line.find(hex, source_end) == string::npos) continue;
+        users.push_back(line.substr(0, source_end) + " " + line.substr(source_end + 1, 1));
+    }
+    return true;
+}
@@ -0,0 +1,66 @@
+/************************************************************************
+*   SCI2FB voice store                                                  *
+*                                                                       *
+*   Content-addressed store of raw 64-byte FB-01 voices. Each unique    *
+*   voice is kept once, and every bank added to the store is recorded   *
+*   as 48 references to its voices.                                     *
+************************************************************************/
+
+#ifndef SCI2FB_VOICE_STORE_H
+#define SCI2FB_VOICE_STORE_H
+
+#include "SCI2FBCore.h"
+
+#include <cstdint>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  A store is a directory holding three files:                                        //
+//                                                                                      //
+//  VOICES.BIN......Every unique voice, 64 bytes each, in the order they were added     //
+//  VOICES.IDX......The 8-byte hash of each voice in VOICES.BIN, in the same order      //
+//  BANKS.TXT.......One line per bank: source, tab, bank letter, tab, then the 48       //
+//                  voice hashes in hex                                                 //
+//                                                                                      //
+//  The files are only ever appended to, so a voice's position never changes.          //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+typedef uint64_t VoiceHash;
+
+VoiceHash hash_voice(const char* voice);
+
+class VoiceStore {
+public:
+    // Opens (creating if needed) the store in directory "dir". Returns false with "error" set on failure.
+    bool open(const std::string& dir, std::string& error);
+
+    // Adds a bank's voices, storing the ones not seen before, and records the bank under "source" and
+    // "bank" (0 for bank A, 1 for bank B). Safe to call from several threads.
+    bool add_bank(const RawBank& data, const std::string& source, int bank);
+
+    // Number of voices added since opening, how many of those weren't in the store yet, and the number of
+    // unique voices the store holds in all
+    size_t voices_added() const { return nAdded; }
+    size_t voices_new() const { return nNew; }
+    size_t voices_stored() const { return hashes.size(); }
+
+    // Lists the recorded banks (as "source bank") that use the voice with the given hash
+    static bool find_voice_users(const std::string& dir, VoiceHash hash, std::vector<std::string>& users, std::string& error);
+
+private:
+    std::string dir;
+    std::mutex store_mutex;
+    std::vector<VoiceHash> hashes;
+    std::unordered_map<VoiceHash, uint32_t> index;
+    std::ofstream voices_file;
+    std::ofstream index_file;
+    std::ofstream banks_file;
+    size_t nAdded = 0;
+    size_t nNew = 0;
+};
+
+#endif
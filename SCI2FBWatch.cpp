@@ -0,0 +1,179 @@
+/************************************************************************
+*   SCI2FB directory watcher                                            *
+*                                                                       *
+*   See SCI2FBWatch.h                                                   *
+************************************************************************/
+
+#include "SCI2FBWatch.h"
+
+#include <algorithm>
+#include <filesystem>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <cerrno>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#endif
+
+using namespace std;
+
+int DirectoryWatcher::quiet_left(int quietMs) const {
+    // How long until the next pending file settles, or -1 to wait for good when nothing is pending
+    if (pending.empty()) return -1;
+    Clock::time_point first = pending.begin()->second;
+    for (const auto& file : pending) first = min(first, file.second);
+    auto left = chrono::duration_cast<chrono::milliseconds>(first + chrono::milliseconds(quietMs) - Clock::now()).count();
+    return static_cast<int>(max<long long>(left, 0));
+}
+
+void DirectoryWatcher::take_settled(vector<string>& changed, int quietMs) {
+    Clock::time_point now = Clock::now();
+    for (auto file = pending.begin(); file != pending.end();) {
+        if (now - file->second < chrono::milliseconds(quietMs)) {
+            ++file;
+            continue;
+        }
+        changed.push_back(file->first);
+        file = pending.erase(file);
+    }
+}
+
+#ifdef _WIN32
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (handle) {
+        CancelIo(handle);
+        CloseHandle(handle);
+    }
+    if (overlapped) {
+        CloseHandle(static_cast<OVERLAPPED*>(overlapped)->hEvent);
+        delete static_cast<OVERLAPPED*>(overlapped);
+    }
+}
+
+bool DirectoryWatcher::open(const string& dir, string& error) {
+    root = dir;
+    handle = CreateFileW(filesystem::path(dir).wstring().c_str(), FILE_LIST_DIRECTORY,
+                         FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING,
+                         FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+        handle = nullptr;
+        error = "could not watch directory " + dir;
+        return false;
+    }
+    OVERLAPPED* ov = new OVERLAPPED();
+    ov->hEvent = CreateEvent(nullptr, TRUE, FALSE, nullptr);
+    overlapped = ov;
+    if (!start_read()) {
+        error = "could not watch directory " + dir;
+        return false;
+    }
+    return true;
+}
+
+bool DirectoryWatcher::start_read() {
+    // Overlapped, so wait() can give up on it after the quiet period instead of blocking for good. The whole
+    // tree is watched by the one handle.
+    OVERLAPPED* ov = static_cast<OVERLAPPED*>(overlapped);
+    HANDLE event = ov->hEvent;
+    *ov = {};
+    ov->hEvent = event;
+    ResetEvent(event);
+    return ReadDirectoryChangesW(handle, buffer, sizeof(buffer), TRUE,
+                                 FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME, nullptr, ov, nullptr) != 0;
+}
+
+bool DirectoryWatcher::wait(vector<string>& changed, int quietMs) {
+    changed.clear();
+    OVERLAPPED* ov = static_cast<OVERLAPPED*>(overlapped);
+    for (;;) {
+        // A read left pending by the last timeout carries over to the next call
+        int timeout = quiet_left(quietMs);
+        bool signalled = WaitForSingleObject(ov->hEvent, (timeout < 0) ? INFINITE : static_cast<DWORD>(timeout)) == WAIT_OBJECT_0;
+
+        // Other files settle while one keeps changing, so they're checked after every batch of changes too
+        DWORD length = 0;
+        if (signalled && !GetOverlappedResult(handle, ov, &length, FALSE)) return false;
+
+        // A length of 0 means the buffer overflowed and the individual changes were lost
+        for (const char* pos = buffer; length > 0;) {
+            const FILE_NOTIFY_INFORMATION* info = reinterpret_cast<const FILE_NOTIFY_INFORMATION*>(pos);
+            if (info->Action == FILE_ACTION_ADDED || info->Action == FILE_ACTION_MODIFIED ||
+                info->Action == FILE_ACTION_RENAMED_NEW_NAME) {
+                wstring name(info->FileName, info->FileNameLength / sizeof(WCHAR));
+                pending[(filesystem::path(root) / name).string()] = Clock::now();
+            }
+            if (info->NextEntryOffset == 0) break;
+            pos += info->NextEntryOffset;
+        }
+        if (signalled && !start_read()) return false;
+        take_settled(changed, quietMs);
+        if (!changed.empty()) return true;
+    }
+}
+
+#else
+
+DirectoryWatcher::~DirectoryWatcher() {
+    if (fd >= 0) close(fd);
+}
+
+bool DirectoryWatcher::open(const string& dir, string& error) {
+    fd = inotify_init1(IN_CLOEXEC);
+    if (fd < 0) {
+        error = "could not start watching " + dir;
+        return false;
+    }
+    add_dir(dir);
+    if (dirs.empty()) {
+        error = "could not watch directory " + dir;
+        return false;
+    }
+    error_code ec;
+    for (const auto& entry : filesystem::recursive_directory_iterator(dir, ec)) {
+        if (entry.is_directory(ec)) add_dir(entry.path().string());
+    }
+    return true;
+}
+
+void DirectoryWatcher::add_dir(const string& dir) {
+    // A finished write shows up as IN_CLOSE_WRITE, and an editor saving through a temporary file as
+    // IN_MOVED_TO. IN_CREATE is only wanted for new directories, so they get watched too.
+    int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    if (wd >= 0) dirs[wd] = dir;
+}
+
+bool DirectoryWatcher::wait(vector<string>& changed, int quietMs) {
+    changed.clear();
+    alignas(inotify_event) char buffer[16384];
+    for (;;) {
+        pollfd fds = { fd, POLLIN, 0 };
+        int ready = poll(&fds, 1, quiet_left(quietMs));
+        if (ready < 0 && errno == EINTR) continue;
+        if (ready < 0) return false;
+
+        // Other files settle while one keeps changing, so they're checked after every batch of events too
+        ssize_t length = (ready > 0) ? read(fd, buffer, sizeof(buffer)) : 0;
+        if (length < 0) return false;
+        for (ssize_t pos = 0; pos < length;) {
+            const inotify_event* event = reinterpret_cast<const inotify_event*>(buffer + pos);
+            pos += sizeof(inotify_event) + event->len;
+            if (event->len == 0 || !dirs.count(event->wd)) continue;
+
+            string path = (filesystem::path(dirs[event->wd]) / event->name).string();
+            if (event->mask & IN_ISDIR) {
+                if (event->mask & (IN_CREATE | IN_MOVED_TO)) add_dir(path);
+            }
+            else if (event->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                pending[path] = Clock::now();
+            }
+        }
+        take_settled(changed, quietMs);
+        if (!changed.empty()) return true;
+    }
+}
+
+#endif
@@ -0,0 +1,52 @@
+/************************************************************************
+*   SCI2FB directory watcher                                            *
+*                                                                       *
+*   Reports files written in a directory tree, for watch mode. Uses     *
+*   inotify on Linux and ReadDirectoryChangesW on Windows.              *
+************************************************************************/
+
+#ifndef SCI2FB_WATCH_H
+#define SCI2FB_WATCH_H
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class DirectoryWatcher {
+public:
+    ~DirectoryWatcher();
+
+    // Starts watching "dir" and every directory beneath it. Returns false with "error" set on failure.
+    bool open(const std::string& dir, std::string& error);
+
+    // Blocks until a file that was written, created or renamed into place has gone "quietMs" without
+    // another change, so a burst of writes to one file is reported once. Each file is timed on its own, so
+    // one being written continuously doesn't hold back the others. "changed" gets the settled files' paths,
+    // without duplicates.
+    bool wait(std::vector<std::string>& changed, int quietMs);
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    std::unordered_map<std::string, Clock::time_point> pending;     // Changed file to its last change
+
+    int quiet_left(int quietMs) const;
+    void take_settled(std::vector<std::string>& changed, int quietMs);
+
+#ifdef _WIN32
+    void* handle = nullptr;
+    void* overlapped = nullptr;
+    std::string root;
+    alignas(4) char buffer[16384];
+
+    bool start_read();
+#else
+    int fd = -1;
+    std::unordered_map<int, std::string> dirs;      // Watch descriptor to the directory it watches
+
+    void add_dir(const std::string& dir);
+#endif
+};
+
+#endif
@@ -0,0 +1,392 @@
+/************************************************************************
+*   SCI2FB ZIP archive access                                           *
+*                                                                       *
+*   Central directory parsing and a small inflater. See SCI2FBZip.h     *
+************************************************************************/
+
+#include "SCI2FBZip.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <memory>
+
+using namespace std;
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  A ZIP archive ends with an end of central directory record, which points to the     //
+//  central directory: one header per entry with its name, sizes, CRC and the offset of //
+//  its local header. The entry's data follows the local header, whose name and extra   //
+//  field lengths can differ from the central directory's copy.                         //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+const uint32_t EOCD_SIGNATURE = 0x06054B50;
+const uint32_t CENTRAL_SIGNATURE = 0x02014B50;
+const uint32_t LOCAL_SIGNATURE = 0x04034B50;
+const size_t EOCD_SIZE = 22;
+const size_t CENTRAL_HEADER_SIZE = 46;
+const size_t LOCAL_HEADER_SIZE = 30;
+
+static uint16_t read_le16(const char* p) {
+    return static_cast<uint16_t>(static_cast<unsigned char>(p[0]) | (static_cast<unsigned char>(p[1]) << 8));
+}
+
+static uint32_t read_le32(const char* p) {
+    return read_le16(p) | (static_cast<uint32_t>(read_le16(p + 2)) << 16);
+}
+
+static bool same_name(const string& a, const string& b) {
+    return a.size() == b.size() && equal(a.begin(), a.end(), b.begin(), [](char x, char y) {
+        return toupper(static_cast<unsigned char>(x)) == toupper(static_cast<unsigned char>(y));
+    });
+}
+
+static uint32_t crc32(const unsigned char* data, size_t length) {
+    // Bitwise CRC-32 (polynomial EDB88320h); it only ever runs over a few KB of patch data
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < length; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++) crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+    }
+    return ~crc;
+}
+
+bool ZipArchive::open(const string& filename, string& error) {
+    if (!archive.open(filename)) {
+        error = "could not open " + filename;
+        return false;
+    }
+    const char* data = archive.data();
+    size_t size = archive.size();
+
+    // The end record sits at the very end unless the archive has a comment, which is at most 64 KB
+    size_t eocd = string::npos;
+    for (size_t pos = (size >= EOCD_SIZE) ? size - EOCD_SIZE + 1 : 0; pos-- > 0 && size - pos <= EOCD_SIZE + 0xFFFF;) {
+        if (read_le32(data + pos) == EOCD_SIGNATURE) {
+            eocd = pos;
+            break;
+        }
+    }
+    if (eocd == string::npos) {
+        error = filename + " is not a ZIP archive";
+        return false;
+    }
+    size_t nEntries = read_le16(data + eocd + 10);
+    uint32_t dirOffset = read_le32(data + eocd + 16);
+    if (nEntries == 0xFFFF || dirOffset == 0xFFFFFFFF) {
+        error = filename + " is a ZIP64 archive, which isn't supported";
+        return false;
+    }
+
+    for (size_t pos = dirOffset, i = 0; i < nEntries; i++) {
+        if (pos + CENTRAL_HEADER_SIZE > size || read_le32(data + pos) != CENTRAL_SIGNATURE) {
+            error = filename + " has a corrupt central directory";
+            return false;
+        }
+        size_t nameLength = read_le16(data + pos + 28);
+        size_t entryLength = CENTRAL_HEADER_SIZE + nameLength + read_le16(data + pos + 30) + read_le16(data + pos + 32);
+        if (pos + entryLength > size) {
+            error = filename + " has a corrupt central directory";
+            return false;
+        }
+
+        string path(data + pos + CENTRAL_HEADER_SIZE, nameLength);
+        replace(path.begin(), path.end(), '\\', '/');
+        bool encrypted = (read_le16(data + pos + 8) & 1) != 0;
+        if (!path.empty() && path.back() != '/' && !encrypted) {
+            ZipEntry entry;
+            size_t slash = path.rfind('/');
+            entry.dir = (slash == string::npos) ? string() : path.substr(0, slash);
+            entry.name = (slash == string::npos) ? path : path.substr(slash + 1);
+            entry.method = read_le16(data + pos + 10);
+            entry.crc = read_le32(data + pos + 16);
+            entry.compressedSize = read_le32(data + pos + 20);
+            entry.size = read_le32(data + pos + 24);
+            entry.headerOffset = read_le32(data + pos + 42);
+            files.push_back(entry);
+        }
+        pos += entryLength;
+    }
+    return true;
+}
+
+const ZipEntry* ZipArchive::find(const string& dir, const string& name) const {
+    for (const ZipEntry& entry : files) {
+        if (same_name(entry.name, name) && same_name(entry.dir, dir)) return &entry;
+    }
+    return nullptr;
+}
+
+bool ZipArchive::extract(const ZipEntry& entry, size_t offset, char* out, size_t length, size_t& outLength, string& error) const {
+    const char* data = archive.data();
+    size_t size = archive.size();
+    size_t pos = entry.headerOffset;
+    if (pos + LOCAL_HEADER_SIZE > size || read_le32(data + pos) != LOCAL_SIGNATURE) {
+        error = entry.name + " has a corrupt local header";
+        return false;
+    }
+    pos += LOCAL_HEADER_SIZE + read_le16(data + pos + 26) + read_le16(data + pos + 28);
+    if (pos + entry.compressedSize > size) {
+        error = entry.name + " is cut short";
+        return false;
+    }
+    const unsigned char* packed = reinterpret_cast<const unsigned char*>(data + pos);
+    unsigned char* dst = reinterpret_cast<unsigned char*>(out);
+
+    outLength = 0;
+    if (entry.method == 0) {
+        if (offset < entry.compressedSize) outLength = min(length, entry.compressedSize - offset);
+        memcpy(dst, packed + offset, outLength);
+    }
+    else if (entry.method == 8) {
+        if (!inflate_range(packed, entry.compressedSize, offset, dst, length, outLength)) {
+            error = entry.name + " is corrupt";
+            return false;
+        }
+    }
+    else {
+        error = entry.name + " uses unsupported compression method " + to_string(entry.method);
+        return false;
+    }
+
+    if (offset == 0 && outLength == entry.size && crc32(dst, outLength) != entry.crc) {
+        error = entry.name + " fails its CRC check";
+        return false;
+    }
+    return true;
+}
+
+//////////////////////////////////////////////////////////////////////////////////////////
+//  Inflate, after the canonical Huffman decoding in zlib's puff.c: each code table is  //
+//  the number of codes of every length plus the symbols in code order, and codes are   //
+//  decoded a bit at a time. That's slower than zlib's lookup tables but needs no setup //
+//  beyond the counts, and patch resources are only a few KB.                           //
+//////////////////////////////////////////////////////////////////////////////////////////
+
+const int MAX_CODE_BITS = 15;
+const size_t WINDOW_SIZE = 32768;
+
+struct HuffmanCode {
+    short count[MAX_CODE_BITS + 1];     // Number of codes of each length
+    short symbol[288];                  // Symbols ordered by code
+};
+
+// Builds a code from the code length of each symbol. Returns 0 for a complete code, a positive number for
+// an incomplete one and a negative number for an over-subscribed one.
+static int build_code(HuffmanCode& code, const short* lengths, int n) {
+    fill(code.count, code.count + MAX_CODE_BITS + 1, static_cast<short>(0));
+    for (int s = 0; s < n; s++) code.count[lengths[s]]++;
+    if (code.count[0] == n) return 0;
+
+    int left = 1;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        left <<= 1;
+        left -= code.count[len];
+        if (left < 0) return left;
+    }
+    short offsets[MAX_CODE_BITS + 1];
+    offsets[1] = 0;
+    for (int len = 1; len < MAX_CODE_BITS; len++) offsets[len + 1] = offsets[len] + code.count[len];
+    for (int s = 0; s < n; s++) {
+        if (lengths[s] != 0) code.symbol[offsets[lengths[s]]++] = static_cast<short>(s);
+    }
+    return left;
+}
+
+class Inflater {
+public:
+    Inflater(const unsigned char* in, size_t inLength, size_t skip, unsigned char* out, size_t length)
+        : in(in), inLength(inLength), skip(skip), out(out), end(skip + length) {}
+
+    bool run(size_t& outLength);
+
+private:
+    const unsigned char* in;
+    size_t inLength;
+    size_t inPos = 0;
+    uint32_t bitBuffer = 0;
+    int bitCount = 0;
+    bool truncated = false;
+
+    size_t skip;
+    unsigned char* out;
+    size_t end;
+    size_t outPos = 0;                  // Bytes inflated so far, kept or not
+    unsigned char window[WINDOW_SIZE];  // The last 32 KB inflated, for back references
+
+    int bits(int need);
+    int decode(const HuffmanCode& code);
+    void put(unsigned char byte);
+    bool done() const { return outPos >= end; }
+    bool stored();
+    bool codes(const HuffmanCode& lengthCode, const HuffmanCode& distanceCode);
+    bool fixed();
+    bool dynamic();
+};
+
+int Inflater::bits(int need) {
+    // Deflate packs from the lowest bit of each byte. Running out of input sets "truncated" and reads zeros,
+    // so the caller only has to check once the block is done.
+    uint32_t value = bitBuffer;
+    while (bitCount < need) {
+        if (inPos >= inLength) {
+            truncated = true;
+            return 0;
+        }
+        value |= static_cast<uint32_t>(in[inPos++]) << bitCount;
+        bitCount += 8;
+    }
+    bitBuffer = value >> need;
+    bitCount -= need;
+    return static_cast<int>(value & ((1u << need) - 1));
+}
+
+int Inflater::decode(const HuffmanCode& code) {
+    int value = 0;
+    int first = 0;
+    int index = 0;
+    for (int len = 1; len <= MAX_CODE_BITS; len++) {
+        value |= bits(1);
+        int count = code.count[len];
+        if (value - count < first) return code.symbol[index + (value - first)];
+        index += count;
+        first = (first + count) << 1;
+        value <<= 1;
+        if (truncated) break;
+    }
+    return -1;
+}
+
+void Inflater::put(unsigned char byte) {
+    window[outPos % WINDOW_SIZE] = byte;
+    if (outPos >= skip && outPos < end) out[outPos - skip] = byte;
+    outPos++;
+}
+
+bool Inflater::stored() {
+    // Byte aligned: the length, its complement, then the bytes as they are
+    bitBuffer = 0;
+    bitCount = 0;
+    if (inPos + 4 > inLength) return false;
+    unsigned length = in[inPos] | (in[inPos + 1] << 8);
+    unsigned complement = in[inPos + 2] | (in[inPos + 3] << 8);
+    inPos += 4;
+    if (length != (~complement & 0xFFFF) || inPos + length > inLength) return false;
+    for (unsigned i = 0; i < length && !done(); i++) put(in[inPos + i]);
+    inPos += length;
+    return true;
+}
+
+bool Inflater::codes(const HuffmanCode& lengthCode, const HuffmanCode& distanceCode) {
+    static const short lengthBase[29] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                          35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+    static const short lengthExtra[29] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                           3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+    static const short distanceBase[30] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385,
+                                            513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+    static const short distanceExtra[30] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7,
+                                             8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+    for (;;) {
+        int symbol = decode(lengthCode);
+        if (symbol < 0 || truncated) return false;
+        if (symbol == 256) return true;
+        if (symbol < 256) {
+            put(static_cast<unsigned char>(symbol));
+        }
+        else {
+            // A length and distance back into what's been inflated already, which may overlap the copy
+            symbol -= 257;
+            if (symbol >= 29) return false;
+            int length = lengthBase[symbol] + bits(lengthExtra[symbol]);
+            symbol = decode(distanceCode);
+            if (symbol < 0 || symbol >= 30) return false;
+            size_t distance = distanceBase[symbol] + bits(distanceExtra[symbol]);
+            if (truncated || distance > outPos) return false;
+            for (int i = 0; i < length; i++) put(window[(outPos - distance) % WINDOW_SIZE]);
+        }
+        if (done()) return true;
+    }
+}
+
+bool Inflater::fixed() {
+    static HuffmanCode lengthCode;
+    static HuffmanCode distanceCode;
+    static bool built = []() {
+        short lengths[288];
+        int s = 0;
+        for (; s < 144; s++) lengths[s] = 8;
+        for (; s < 256; s++) lengths[s] = 9;
+        for (; s < 280; s++) lengths[s] = 7;
+        for (; s < 288; s++) lengths[s] = 8;
+        build_code(lengthCode, lengths, 288);
+        for (s = 0; s < 30; s++) lengths[s] = 5;
+        build_code(distanceCode, lengths, 30);
+        return true;
+    }();
+    (void)built;
+    return codes(lengthCode, distanceCode);
+}
+
+bool Inflater::dynamic() {
+    static const short order[19] = { 16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15 };
+    int nLengths = bits(5) + 257;
+    int nDistances = bits(5) + 1;
+    int nCodes = bits(4) + 4;
+    if (truncated || nLengths > 286 || nDistances > 30) return false;
+
+    // The code lengths of the two codes are themselves Huffman coded, using a code sent first
+    short lengths[286 + 30] = {};
+    for (int i = 0; i < nCodes; i++) lengths[order[i]] = static_cast<short>(bits(3));
+    HuffmanCode lengthCode;
+    HuffmanCode distanceCode;
+    if (truncated || build_code(lengthCode, lengths, 19) != 0) return false;
+
+    for (int index = 0; index < nLengths + nDistances;) {
+        int symbol = decode(lengthCode);
+        if (symbol < 0) return false;
+        if (symbol < 16) {
+            lengths[index++] = static_cast<short>(symbol);
+            continue;
+        }
+        // 16 repeats the previous length 3-6 times, 17 and 18 give runs of zero lengths
+        short repeat = 0;
+        int count = 0;
+        if (symbol == 16) {
+            if (index == 0) return false;
+            repeat = lengths[index - 1];
+            count = 3 + bits(2);
+        }
+        else {
+            count = (symbol == 17) ? 3 + bits(3) : 11 + bits(7);
+        }
+        if (truncated || index + count > nLengths + nDistances) return false;
+        while (count--) lengths[index++] = repeat;
+    }
+    if (lengths[256] == 0) return false;
+
+    // An incomplete code is only allowed when it's a single code
+    int left = build_code(lengthCode, lengths, nLengths);
+    if (left < 0 || (left > 0 && nLengths - lengthCode.count[0] != 1)) return false;
+    left = build_code(distanceCode, lengths + nLengths, nDistances);
+    if (left < 0 || (left > 0 && nDistances - distanceCode.count[0] != 1)) return false;
+    return codes(lengthCode, distanceCode);
+}
+
+bool Inflater::run(size_t& outLength) {
+    bool last = false;
+    while (!last && !done()) {
+        last = bits(1) != 0;
+        int type = bits(2);
+        if (truncated) return false;
+        bool ok = (type == 0) ? stored() : (type == 1) ? fixed() : (type == 2) ? dynamic() : false;
+        if (!ok) return false;
+    }
+    outLength = (outPos > skip) ? min(outPos, end) - skip : 0;
+    return true;
+}
+
+bool inflate_range(const unsigned char* in, size_t inLength, size_t skip, unsigned char* out, size_t length, size_t& outLength) {
+    // The 32 KB window is too big for the stack of a worker thread on some platforms
+    unique_ptr<Inflater> inflater = make_unique<Inflater>(in, inLength, skip, out, length);
+    return inflater->run(outLength);
+}
@@ -0,0 +1,54 @@
+/************************************************************************
+*   SCI2FB ZIP archive access                                           *
+*                                                                       *
+*   Reads files straight out of ZIP archives of game dumps, inflating   *
+*   only as much of an entry as is asked for, so a patch resource can   *
+*   be converted without unpacking the archive first.                   *
+************************************************************************/
+
+#ifndef SCI2FB_ZIP_H
+#define SCI2FB_ZIP_H
+
+#include "SCI2FBMap.h"
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+struct ZipEntry {
+    std::string dir;            // Directory inside the archive, without the trailing '/' ("" at the top)
+    std::string name;
+    uint16_t method;            // 0 = stored, 8 = deflated
+    uint32_t crc;
+    uint32_t compressedSize;
+    uint32_t size;
+    uint32_t headerOffset;      // Offset of the entry's local header
+};
+
+class ZipArchive {
+public:
+    // Maps the archive and reads its central directory. Returns false with "error" set when it isn't a ZIP
+    // archive this can read (ZIP64 and encrypted archives aren't supported).
+    bool open(const std::string& filename, std::string& error);
+
+    const std::vector<ZipEntry>& entries() const { return files; }
+
+    // The entry called "name" in directory "dir", both matched ignoring case, or nullptr
+    const ZipEntry* find(const std::string& dir, const std::string& name) const;
+
+    // Unpacks up to "length" bytes of "entry" starting "offset" bytes into it. Inflating stops as soon as
+    // they're out, so reading near the start of a large entry is cheap. "outLength" is less than "length"
+    // when the entry ends first. A whole entry unpacked from the start has its CRC checked.
+    bool extract(const ZipEntry& entry, size_t offset, char* out, size_t length, size_t& outLength, std::string& error) const;
+
+private:
+    MappedFile archive;
+    std::vector<ZipEntry> files;
+};
+
+// Inflates raw deflate data (RFC 1951), keeping only output bytes [skip, skip + length), and stopping
+// once they're done. Returns false when the data is corrupt or cut short.
+bool inflate_range(const unsigned char* in, size_t inLength, size_t skip, unsigned char* out, size_t length, size_t& outLength);
+
+#endif